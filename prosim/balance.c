@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "balance.h"
+#include "checkpoint.h"
+
+/* A node as seen by a balancer, keyed on its load or on the number of processes it can give up.
+ */
+typedef struct balance_node {
+    int index;
+    int key;
+} balance_node;
+
+/* Saved balancer of the run and its settings
+ */
+typedef struct {
+    char name[8];               /* empty if processes stay on their nodes */
+    int period;
+    int cost;
+    long long last_push;
+} balance_record;
+
+static int period;
+static int cost;
+static long long last_push;
+
+/* Scratch arrays, only used by the thread balancing
+ */
+static balance_node *loaded;
+static balance_node *idle;
+static int capacity;
+
+extern void balance_init(int balance_period, int migration_cost) {
+    assert(balance_period > 0 && migration_cost >= 0);
+    period = balance_period;
+    cost = migration_cost;
+    last_push = 0;
+}
+
+/* Makes room in the scratch arrays for every node
+ */
+static void balance_reserve(int num_nodes) {
+    if (num_nodes <= capacity) {
+        return;
+    }
+    capacity = num_nodes;
+    loaded = realloc(loaded, capacity * sizeof(balance_node));
+    idle = realloc(idle, capacity * sizeof(balance_node));
+    assert(loaded && idle);
+}
+
+/* Orders nodes on increasing key, then on node order so that balancing does not depend on the sort
+ */
+static int balance_compare(const void *a, const void *b) {
+    const balance_node *x = a;
+    const balance_node *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+/* push: every period ticks, spreads the load evenly over the nodes.
+ * The nodes are sorted on load and each is given a share of the total, the most loaded ones
+ * taking the remainder. Nodes above their share then push ready processes to the nodes below theirs,
+ * the most loaded to the least loaded first.
+ */
+static int push_balance(processor_t **cpus, int num_nodes, long long now) {
+    if (now - last_push < period) {
+        return 0;
+    }
+    last_push = now;
+    balance_reserve(num_nodes);
+
+    int n = 0;
+    int total = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        int load = process_load(cpus[i]);
+        if (load >= 0) {
+            loaded[n].index = i;
+            loaded[n].key = load;
+            total += load;
+            n++;
+        }
+    }
+    if (n < 2) {
+        return 0;
+    }
+    qsort(loaded, n, sizeof(balance_node), balance_compare);
+
+    int share = total / n;
+    int first_extra = n - total % n;
+    int moved = 0;
+    int lo = 0;
+    int hi = n - 1;
+    while (lo < hi) {
+        processor_t *from = cpus[loaded[hi].index];
+        if (loaded[hi].key <= share + (hi >= first_extra) || process_movable(from) == 0) {
+            hi--;
+        }
+        else if (loaded[lo].key >= share + (lo >= first_extra)) {
+            lo++;
+        }
+        else {
+            process_migrate(from, cpus[loaded[lo].index], now, cost);
+            loaded[hi].key--;
+            loaded[lo].key++;
+            moved++;
+        }
+    }
+    return moved;
+}
+
+/* pull: at every synchronization, each idle node steals a ready process from the node with the
+ * most ready processes. A node is only stolen from while it has something else to run.
+ */
+static int pull_balance(processor_t **cpus, int num_nodes, long long now) {
+    balance_reserve(num_nodes);
+
+    int num_idle = 0;
+    int num_donors = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        int load = process_load(cpus[i]);
+        if (load == 0) {
+            idle[num_idle].index = i;
+            idle[num_idle].key = 0;
+            num_idle++;
+        }
+        else if (load >= 2 && process_movable(cpus[i]) > 0) {
+            /* Donors are sorted on decreasing number of ready processes
+             */
+            loaded[num_donors].index = i;
+            loaded[num_donors].key = -process_movable(cpus[i]);
+            num_donors++;
+        }
+    }
+    if (num_idle == 0 || num_donors == 0) {
+        return 0;
+    }
+    qsort(loaded, num_donors, sizeof(balance_node), balance_compare);
+
+    int moved = 0;
+    for (int i = 0; i < num_idle && loaded[0].key < 0; i++) {
+        processor_t *from = cpus[loaded[0].index];
+        process_migrate(from, cpus[idle[i].index], now, cost);
+        moved++;
+
+        /* The donor gave up one process, move it down past the donors that now have more
+         */
+        loaded[0].key = process_load(from) >= 2 ? -process_movable(from) : 0;
+        for (int j = 0; j + 1 < num_donors && balance_compare(&loaded[j], &loaded[j + 1]) > 0; j++) {
+            balance_node swap = loaded[j];
+            loaded[j] = loaded[j + 1];
+            loaded[j + 1] = swap;
+        }
+    }
+    return moved;
+}
+
+static const balancer_t balancers[] = {
+    {"push", push_balance},
+    {"pull", pull_balance},
+};
+
+#define NUM_BALANCERS (int)(sizeof(balancers) / sizeof(balancers[0]))
+
+extern const balancer_t *balance_find(const char *name) {
+    for (int i = 0; i < NUM_BALANCERS; i++) {
+        if (!strcmp(balancers[i].name, name)) {
+            return &balancers[i];
+        }
+    }
+    return NULL;
+}
+
+extern const char *balance_names() {
+    return "push|pull";
+}
+
+extern void balance_save(checkpoint_t *ck, const balancer_t *balancer) {
+    balance_record record;
+    memset(&record, 0, sizeof(record));
+    if (balancer) {
+        strncpy(record.name, balancer->name, sizeof(record.name) - 1);
+    }
+    record.period = period;
+    record.cost = cost;
+    record.last_push = last_push;
+    checkpoint_put(ck, &record, sizeof(record));
+}
+
+extern int balance_restore(checkpoint_t *ck, const balancer_t **balancer) {
+    const balance_record *record = checkpoint_get(ck, sizeof(balance_record));
+    if (!record || record->period <= 0 || record->cost < 0) {
+        return 0;
+    }
+    char name[sizeof(record->name) + 1] = {0};
+    memcpy(name, record->name, sizeof(record->name));
+    *balancer = name[0] ? balance_find(name) : NULL;
+    if (name[0] && !*balancer) {
+        return 0;
+    }
+    balance_init(record->period, record->cost);
+    last_push = record->last_push;
+    return 1;
+}
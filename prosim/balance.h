@@ -0,0 +1,72 @@
+#ifndef BALANCE_H
+#define BALANCE_H
+
+#include "process.h"
+
+struct checkpoint;
+
+/* Load balancing between nodes.
+ * Between two steps of the nodes, every node is stopped at a tick boundary, so a balancer can move
+ * ready processes from one node to another (see process_migrate). A moved process keeps its address
+ * and statistics, runs on its new node from then on and receives its messages there.
+ * Balancers run on one thread at a time, while no node is stepping.
+ */
+
+typedef struct balancer {
+    const char *name;
+
+    /* Moves ready processes between nodes
+     * @params:
+     *   cpus     : node contexts
+     *   num_nodes: number of nodes
+     *   now      : tick the nodes have reached, no earlier than the clock of any node
+     * @returns:
+     *   number of processes moved
+     */
+    int (*balance)(processor_t **cpus, int num_nodes, long long now);
+} balancer_t;
+
+/* Sets up load balancing
+ * @params:
+ *   period: number of ticks between two rounds of the push balancer
+ *   cost  : number of ticks a moved process cannot run for on its new node
+ * @returns:
+ *   none
+ */
+extern void balance_init(int period, int cost);
+
+/* Finds a balancer by name
+ * @params:
+ *   name: push or pull
+ * @returns:
+ *   pointer to the balancer or NULL if there is no such balancer
+ */
+extern const balancer_t *balance_find(const char *name);
+
+/* Returns the names of all balancers, separated by '|', for usage messages
+ * @params:
+ *   none
+ * @returns:
+ *   the names
+ */
+extern const char *balance_names();
+
+/* Saves the balancer of the run and its settings and progress
+ * @params:
+ *   ck      : checkpoint being written
+ *   balancer: balancer of the run or NULL
+ * @returns:
+ *   none
+ */
+extern void balance_save(struct checkpoint *ck, const balancer_t *balancer);
+
+/* Restores what balance_save saved
+ * @params:
+ *   ck      : checkpoint being restored
+ *   balancer: where to store the balancer of the run, NULL if there was none
+ * @returns:
+ *   1 on success, 0 if the checkpoint is damaged
+ */
+extern int balance_restore(struct checkpoint *ck, const balancer_t **balancer);
+
+#endif
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
 #include "barrier.h"
 
 typedef struct thread_args {
@@ -41,7 +42,49 @@ static void *thread_runner(void *arg) {
     return NULL;
 }
 
-int main() {
+/* Barrier throughput benchmark: every thread crosses the barrier a fixed number of times.
+ */
+static void *bench_runner(void *arg) {
+    int rounds = *(int *)arg;
+    for (int i = 0; i < rounds; i++) {
+        barrier_wait();
+    }
+    complete_barrier();
+    return NULL;
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(int max_threads, int rounds) {
+    pthread_t *tid = calloc(max_threads, sizeof(pthread_t));
+
+    printf("%8s %16s\n", "threads", "crossings/sec");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        create_barrier(n);
+
+        double start = now_sec();
+        for (int i = 0; i < n; i++) {
+            int result = pthread_create(&tid[i], NULL, bench_runner, &rounds);
+            assert(result == 0);
+        }
+        for (int i = 0; i < n; i++) {
+            int result = pthread_join(tid[i], NULL);
+            assert(result == 0);
+        }
+        double elapsed = now_sec() - start;
+
+        printf("%8d %16.0f\n", n, rounds / elapsed);
+    }
+    free(tid);
+}
+
+/* Usage: bar_test [max threads for benchmark] [rounds per benchmark run]
+ */
+int main(int argc, char **argv) {
     int num_threads = 16;
     thread_args *args = calloc(num_threads, sizeof(thread_args));
     pthread_t *tid = calloc(num_threads, sizeof(pthread_t));
@@ -82,5 +125,9 @@ int main() {
         printf("No oops\n");
     }
 
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    int rounds = argc > 2 ? atoi(argv[2]) : 100000;
+    bench(max_threads, rounds);
+
     return 0;
 }
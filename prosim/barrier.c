@@ -1,15 +1,68 @@
-#include <pthread.h>
-#include <assert.h>
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "barrier.h"
+
+/* Sense-reversing barrier without locks.
+ * The number of threads using the barrier and the number that have arrived in the current round
+ * are packed into one 64-bit word, so an arrival and a thread leaving early can never both think
+ * they were last. The generation number is the shared sense: waiters wait for it to change.
+ * Waiters spin on the generation for a while and then park on it with a futex.
+ * The shared words are each given their own cache line so that arrivals do not invalidate the line
+ * the spinning threads are reading.
+ * Each round also computes the minimum of the values passed by the arriving threads. Rounds
+ * alternate between two minimum slots, so the next round can start filling one while threads
+ * released from the previous round are still reading the other.
+ */
+#define CACHE_LINE 64
+#define SPIN_LIMIT 2000
+#define ARRIVED_MASK 0xffffffffULL
+#define ONE_THREAD (1ULL << 32)
+
 //Global variables
 
-//Mutex to ensure exlusice access
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+//Number of threads in the high half, number of threads arrived in the low half
+static _Alignas(CACHE_LINE) _Atomic unsigned long long state = 0;
+//Incremented to release a round, also the futex word parked threads sleep on
+static _Alignas(CACHE_LINE) _Atomic int generation = 0;
+//Number of threads parked, so a release only makes a system call when it has to
+static _Alignas(CACHE_LINE) _Atomic int sleepers = 0;
+//Minimum of the values passed in by the arrivals, one slot for even and one for odd generations
+static struct {
+    _Alignas(CACHE_LINE) _Atomic long long value;
+} minimum[2] = {{LLONG_MAX}, {LLONG_MAX}};
+//Number of spins before parking, zero when there are more threads than processors
+static int spin_limit = SPIN_LIMIT;
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Release the threads waiting in the current round.
+ * Called by exactly one thread: the last one to arrive, or a thread leaving that made it so.
+ */
+static void release(int gen) {
+    /* The slot for the next round must be clear before anyone is let into it.
+     */
+    atomic_store(&minimum[(gen + 1) & 1].value, LLONG_MAX);
 
-static int max_threads = 0;
-static int waiters = 0;
-static int generation = 0;
+    /* Clear the arrived count before bumping the generation, so that released threads
+     * arriving at the next round count from zero.
+     */
+    unsigned long long old = atomic_load(&state);
+    while (!atomic_compare_exchange_weak(&state, &old, old & ~ARRIVED_MASK));
+
+    atomic_fetch_add(&generation, 1);
+    if (atomic_load(&sleepers) > 0) {
+        syscall(SYS_futex, &generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
 
 /**
  *Create the barrier for use with threads
@@ -17,44 +70,62 @@ static int generation = 0;
  *
  */
 void create_barrier(int n) {
-    pthread_mutex_lock(&lock);
-    max_threads = n;
-    waiters = 0;
-    generation = 0;
-    pthread_mutex_unlock(&lock);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    spin_limit = (cpus > 0 && n > cpus) ? 0 : SPIN_LIMIT;
+    atomic_store(&state, (unsigned long long)n << 32);
+    atomic_store(&sleepers, 0);
+    atomic_store(&minimum[0].value, LLONG_MAX);
+    atomic_store(&minimum[1].value, LLONG_MAX);
 }
 
 /**
  * Wait untill all threads reach this area and after that release
  */
 void barrier_wait() {
-    pthread_mutex_lock(&lock);
-    int gen = generation;
-
-    waiters++;
-    if (waiters == max_threads) {
-        generation++;
-        waiters = 0;
-        pthread_cond_broadcast(&cond);
-    } else {
-        while (gen == generation) {
-            pthread_cond_wait(&cond, &lock);
+    barrier_wait_next(LLONG_MAX);
+}
+
+/**
+ * Wait until all threads reach this area, then release them all
+ * @param value this thread's contribution to the round
+ * @return the smallest value passed in by any thread in this round
+ */
+long long barrier_wait_next(long long value) {
+    int gen = atomic_load(&generation);
+    _Atomic long long *slot = &minimum[gen & 1].value;
+
+    long long cur = atomic_load(slot);
+    while (value < cur && !atomic_compare_exchange_weak(slot, &cur, value));
+
+    unsigned long long now = atomic_fetch_add(&state, 1) + 1;
+    if ((now & ARRIVED_MASK) == (now >> 32)) {
+        long long result = atomic_load(slot);
+        release(gen);
+        return result;
+    }
+
+    for (int i = 0; i < spin_limit; i++) {
+        if (atomic_load_explicit(&generation, memory_order_acquire) != gen) {
+            return atomic_load(slot);
         }
+        cpu_relax();
     }
 
-    pthread_mutex_unlock(&lock);
+    atomic_fetch_add(&sleepers, 1);
+    while (atomic_load(&generation) == gen) {
+        syscall(SYS_futex, &generation, FUTEX_WAIT_PRIVATE, gen, NULL, NULL, 0);
+    }
+    atomic_fetch_sub(&sleepers, 1);
+    return atomic_load(slot);
 }
 /***
 *This function indicates that a thread has finished using the barrier
 *Decrease the total thread count for future use cases
 */
 void complete_barrier() {
-    pthread_mutex_lock(&lock);
-    max_threads--;
-    if (waiters == max_threads) {
-        generation++;
-        waiters = 0;
-        pthread_cond_broadcast(&cond);
+    unsigned long long now = atomic_fetch_sub(&state, ONE_THREAD) - ONE_THREAD;
+    unsigned long long arrived = now & ARRIVED_MASK;
+    if (arrived > 0 && arrived == (now >> 32)) {
+        release(atomic_load(&generation));
     }
-    pthread_mutex_unlock(&lock);
 }
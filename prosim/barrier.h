@@ -4,7 +4,8 @@
 
 #ifndef BARRIER_H
 #define BARRIER_H
-void create_barrier();
+void create_barrier(int n);
 void barrier_wait();
+long long barrier_wait_next(long long value);
 void complete_barrier();
-#endif
\ No newline at end of file
+#endif
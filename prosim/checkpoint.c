@@ -0,0 +1,277 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+#define ALIGN 8
+
+/* Saved process context. The record is followed by the process's code and by its loop stack,
+ * which is saved at full size so that the restored process can use it from the mapping.
+ */
+typedef struct {
+    char name[12];
+    int code_size;
+    int depth;                  /* number of entries on the loop stack */
+    int ip;
+    int id;
+    int priority;
+    int state;
+    int doop_count;
+    int block_count;
+    int thread;
+    int send_count;
+    int recv_count;
+    int sched_level;
+    int node;
+    int dispatch_count;
+    long long duration;
+    long long enqueue_time;
+    long long doop_time;
+    long long block_time;
+    long long wait_time;
+    long long finished;
+    long long msg_arrival;
+    long long vruntime;
+    long long arrival;
+    long long block_start;
+    long long link_priority;    /* key and insertion order of the process in its queue */
+    unsigned long long link_seq;
+} proc_record;
+
+/***
+*Starts writing a checkpoint to a temporary file next to the one it replaces
+*/
+extern checkpoint_t *checkpoint_create(const char *path) {
+    checkpoint_t *ck = calloc(1, sizeof(checkpoint_t));
+    assert(ck);
+    ck->path = malloc(strlen(path) + 5);
+    assert(ck->path);
+    sprintf(ck->path, "%s.tmp", path);
+
+    ck->fout = fopen(ck->path, "wb");
+    if (!ck->fout) {
+        fprintf(stderr, "Bad checkpoint, could not write %s\n", ck->path);
+        free(ck->path);
+        free(ck);
+        return NULL;
+    }
+    return ck;
+}
+/***
+*Appends a record, padded to the next 8 byte boundary
+*/
+extern void checkpoint_put(checkpoint_t *ck, const void *data, size_t size) {
+    static const char padding[ALIGN];
+    fwrite(data, 1, size, ck->fout);
+    ck->pos += size;
+    if (ck->pos % ALIGN) {
+        fwrite(padding, 1, ALIGN - ck->pos % ALIGN, ck->fout);
+        ck->pos += ALIGN - ck->pos % ALIGN;
+    }
+}
+/***
+*Closes the temporary file and renames it over the checkpoint, so a crash never leaves half a checkpoint
+*/
+extern int checkpoint_commit(checkpoint_t *ck) {
+    int ok = !ferror(ck->fout);
+    ok = fclose(ck->fout) == 0 && ok;
+
+    char *final = strdup(ck->path);
+    assert(final);
+    final[strlen(final) - 4] = '\0';
+    if (ok) {
+        ok = rename(ck->path, final) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Bad checkpoint, could not write %s\n", final);
+        remove(ck->path);
+    }
+    free(final);
+    free(ck->path);
+    free(ck);
+    return ok;
+}
+/***
+*Maps a checkpoint into memory. The mapping is private and writable, and is never unmapped:
+*restored processes keep running their code and stacks from it.
+*/
+extern checkpoint_t *checkpoint_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Bad checkpoint, could not open %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Bad checkpoint, could not map %s\n", path);
+        return NULL;
+    }
+
+    checkpoint_t *ck = calloc(1, sizeof(checkpoint_t));
+    assert(ck);
+    ck->base = base;
+    ck->size = st.st_size;
+    return ck;
+}
+/***
+*Returns the next record in place and moves past it and its padding
+*/
+extern const void *checkpoint_get(checkpoint_t *ck, size_t size) {
+    size_t padded = (size + ALIGN - 1) / ALIGN * ALIGN;
+    if (ck->pos > ck->size || padded > ck->size - ck->pos) {
+        return NULL;
+    }
+    const void *record = ck->base + ck->pos;
+    ck->pos += padded;
+    return record;
+}
+
+extern int checkpoint_index(real_priority *proc) {
+    return proc ? proc->index : -1;
+}
+
+extern int checkpoint_proc(checkpoint_t *ck, int index, real_priority **proc) {
+    if (index < -1 || index >= ck->num_procs) {
+        return 0;
+    }
+    *proc = index < 0 ? NULL : ck->procs[index];
+    return 1;
+}
+/***
+*Saves the number of processes, then one record per process followed by its code and loop stack
+*/
+extern void checkpoint_save_procs(checkpoint_t *ck, real_priority **procs, int num_procs) {
+    checkpoint_put(ck, &num_procs, sizeof(int));
+    for (int i = 0; i < num_procs; i++) {
+        real_priority *cur = procs[i];
+        proc_record record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.name, cur->name, sizeof(cur->name));
+        record.code_size = cur->code_size;
+        record.depth = (int)(cur->stack - cur->stack_base);
+        record.ip = cur->ip;
+        record.id = cur->id;
+        record.priority = cur->priority;
+        record.duration = cur->duration;
+        record.state = cur->state;
+        record.enqueue_time = cur->enqueue_time;
+        record.doop_count = cur->doop_count;
+        record.doop_time = cur->doop_time;
+        record.block_count = cur->block_count;
+        record.block_time = cur->block_time;
+        record.wait_time = cur->wait_time;
+        record.thread = cur->thread;
+        record.finished = cur->finished;
+        record.send_count = cur->send_count;
+        record.recv_count = cur->recv_count;
+        record.msg_arrival = cur->msg_arrival;
+        record.sched_level = cur->sched_level;
+        record.vruntime = cur->vruntime;
+        record.node = cur->node;
+        record.arrival = cur->arrival;
+        record.dispatch_count = cur->dispatch_count;
+        record.block_start = cur->block_start;
+        record.link_priority = cur->link.priority;
+        record.link_seq = cur->link.seq;
+        checkpoint_put(ck, &record, sizeof(record));
+        checkpoint_put(ck, cur->code, cur->code_size * sizeof(opcode));
+
+        /* Only the live part of the stack is meaningful, the rest is saved as zeroes
+         */
+        int capacity = 2 * cur->code_size;
+        int *stack = calloc(capacity + 1, sizeof(int));
+        assert(stack);
+        memcpy(stack, cur->stack_base, record.depth * sizeof(int));
+        checkpoint_put(ck, stack, capacity * sizeof(int));
+        free(stack);
+    }
+}
+/***
+*Returns true if restored code only holds known primitives and its loops jump inside it
+*/
+static int checkpoint_code_valid(const opcode *code, int code_size) {
+    for (int i = 0; i < code_size; i++) {
+        if (code[i].op < 0 || code[i].op >= OP_LAST) {
+            return 0;
+        }
+        if ((code[i].op == OP_LOOP || code[i].op == OP_END) &&
+            (code[i].target < 0 || code[i].target >= code_size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+/***
+*Restores the process contexts, pointing their code and stacks into the mapping
+*A process that was never admitted is still before its first primitive, and one whose program is empty
+*has run off its end, otherwise the process is at a primitive of its code.
+*/
+extern int checkpoint_restore_procs(checkpoint_t *ck) {
+    const int *num_procs = checkpoint_get(ck, sizeof(int));
+    if (!num_procs || *num_procs < 0) {
+        return 0;
+    }
+    ck->num_procs = *num_procs;
+    ck->procs = calloc(ck->num_procs + 1, sizeof(real_priority *));
+    real_priority *contexts = calloc(ck->num_procs + 1, sizeof(real_priority));
+    assert(ck->procs && contexts);
+
+    for (int i = 0; i < ck->num_procs; i++) {
+        const proc_record *record = checkpoint_get(ck, sizeof(proc_record));
+        if (!record || record->code_size < 0 || record->depth < 0 || record->depth > record->code_size ||
+            record->ip < -1 || (record->ip >= record->code_size && record->code_size > 0)) {
+            return 0;
+        }
+        opcode *code = (opcode *)checkpoint_get(ck, record->code_size * sizeof(opcode));
+        int *stack = (int *)checkpoint_get(ck, 2 * record->code_size * sizeof(int));
+        if (!code || !stack || !checkpoint_code_valid(code, record->code_size)) {
+            return 0;
+        }
+
+        real_priority *cur = &contexts[i];
+        memcpy(cur->name, record->name, sizeof(cur->name));
+        cur->name[sizeof(cur->name) - 1] = '\0';
+        cur->code = code;
+        cur->code_size = record->code_size;
+        cur->stack_base = stack;
+        cur->stack = stack + record->depth;
+        cur->ip = record->ip;
+        cur->id = record->id;
+        cur->priority = record->priority;
+        cur->duration = record->duration;
+        cur->state = record->state;
+        cur->enqueue_time = record->enqueue_time;
+        cur->doop_count = record->doop_count;
+        cur->doop_time = record->doop_time;
+        cur->block_count = record->block_count;
+        cur->block_time = record->block_time;
+        cur->wait_time = record->wait_time;
+        cur->thread = record->thread;
+        cur->finished = record->finished;
+        cur->send_count = record->send_count;
+        cur->recv_count = record->recv_count;
+        cur->msg_arrival = record->msg_arrival;
+        cur->sched_level = record->sched_level;
+        cur->vruntime = record->vruntime;
+        cur->node = record->node;
+        cur->arrival = record->arrival;
+        cur->dispatch_count = record->dispatch_count;
+        cur->block_start = record->block_start;
+        cur->link.priority = record->link_priority;
+        cur->link.seq = record->link_seq;
+        cur->index = i;
+        ck->procs[i] = cur;
+    }
+    return 1;
+}
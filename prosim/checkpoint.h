@@ -0,0 +1,105 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stddef.h>
+#include "context.h"
+
+/* Checkpoint files of the simulation (see engine_checkpoint and engine_restore).
+ * A checkpoint is a flat file of fixed-layout records, each starting on an 8 byte boundary and in the
+ * byte order of the machine that wrote it. Restoring maps the file into memory and reads the records
+ * in place: the code and loop stacks of the processes are used straight from the mapping, which is
+ * private, so the restored run never writes to the file.
+ * Every module saves and restores its own state, naming processes by their index in the input.
+ */
+
+typedef struct checkpoint {
+    FILE *fout;                 /* file being written, NULL while restoring */
+    char *path;                 /* file to replace once the checkpoint is complete */
+    char *base;                 /* mapping of the file being restored */
+    size_t size;                /* size of the mapping */
+    size_t pos;                 /* offset of the next record */
+    real_priority **procs;      /* every process, by index */
+    int num_procs;
+} checkpoint_t;
+
+/* Starts writing a checkpoint. The checkpoint goes to a temporary file until checkpoint_commit.
+ * @params:
+ *   path: file to write
+ * @returns:
+ *   pointer to the checkpoint, or prints an error and returns NULL
+ */
+extern checkpoint_t *checkpoint_create(const char *path);
+
+/* Appends a record to a checkpoint being written
+ * @params:
+ *   ck  : checkpoint being written
+ *   data: record
+ *   size: size of the record in bytes
+ * @returns:
+ *   none
+ */
+extern void checkpoint_put(checkpoint_t *ck, const void *data, size_t size);
+
+/* Finishes writing a checkpoint and puts it in place of the file it was created for
+ * @params:
+ *   ck: checkpoint being written, freed
+ * @returns:
+ *   1 on success, or prints an error and returns 0
+ */
+extern int checkpoint_commit(checkpoint_t *ck);
+
+/* Opens a checkpoint to restore, mapping the file into memory for good
+ * @params:
+ *   path: file to read
+ * @returns:
+ *   pointer to the checkpoint, or prints an error and returns NULL
+ */
+extern checkpoint_t *checkpoint_open(const char *path);
+
+/* Reads the next record of a checkpoint being restored
+ * @params:
+ *   ck  : checkpoint being restored
+ *   size: size of the record in bytes
+ * @returns:
+ *   pointer to the record in the mapping, or NULL if the file is too short
+ */
+extern const void *checkpoint_get(checkpoint_t *ck, size_t size);
+
+/* Returns the index that names a process in a checkpoint
+ * @params:
+ *   proc: pointer to process context or NULL
+ * @returns:
+ *   the index of the process, or -1 for NULL
+ */
+extern int checkpoint_index(real_priority *proc);
+
+/* Returns the process a checkpoint names by its index
+ * @params:
+ *   ck   : checkpoint being restored
+ *   index: index read from the checkpoint
+ *   proc : where to store the process, NULL for index -1
+ * @returns:
+ *   1 if the index is -1 or names a process, 0 otherwise
+ */
+extern int checkpoint_proc(checkpoint_t *ck, int index, real_priority **proc);
+
+/* Saves every process context: its code, loop stack, position, state and statistics
+ * @params:
+ *   ck       : checkpoint being written
+ *   procs    : every process, by index
+ *   num_procs: number of processes
+ * @returns:
+ *   none
+ */
+extern void checkpoint_save_procs(checkpoint_t *ck, real_priority **procs, int num_procs);
+
+/* Restores the process contexts saved by checkpoint_save_procs into ck->procs
+ * Processes are not in any queue yet, the modules that held them put them back.
+ * @params:
+ *   ck: checkpoint being restored
+ * @returns:
+ *   1 on success, 0 if the checkpoint is damaged
+ */
+extern int checkpoint_restore_procs(checkpoint_t *ck);
+
+#endif
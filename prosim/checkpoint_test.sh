@@ -0,0 +1,170 @@
+#!/bin/bash
+
+# Checks that a checkpoint taken during a run restores to the rest of that run.
+# Each configuration is run three times with --sequential: straight through, with --checkpoint
+# at a tick, and with --restore from that checkpoint. Taking the checkpoint must not change the
+# output, and the restored run must print exactly the end of the uninterrupted one, trace and
+# summary alike: everything after the trace lines before the tick the checkpoint says its run
+# had written out.
+#
+# USAGE:
+#   ./checkpoint_test.sh [prosim]
+
+EXE=${1:-./prosim}
+if [ ! -x $EXE ]; then
+	echo Cannot find $EXE
+	exit 1
+fi
+
+# Every run of the small input takes well under a second, so one that runs longer is stuck
+RUN="timeout 10 $EXE"
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+# Three nodes with rendezvous, buffered sends, collectives, loops, and a busy first node to balance.
+cat > $DIR/input.txt <<EOF
+9 4 3
+root 6 1 1
+LOOP 3
+DOOP 4
+BCAST 101
+BARRIER 7
+END
+HALT
+p 6 2 1
+LOOP 4
+DOOP 3
+SEND 202
+RECV 202
+END
+HALT
+b 6 3 1
+DOOP 20
+LOOP 5
+RECV 302
+DOOP 2
+END
+HALT
+c 3 1 1
+DOOP 15
+DOOP 10
+HALT
+w1 6 1 2
+LOOP 3
+DOOP 2
+BCAST 101
+BARRIER 7
+END
+HALT
+q 6 2 2
+LOOP 4
+RECV 102
+DOOP 2
+SEND 102
+END
+HALT
+w2 6 1 3
+LOOP 3
+DOOP 6
+BCAST 101
+BARRIER 7
+END
+HALT
+a 5 2 3
+LOOP 5
+DOOP 1
+ASEND 103
+END
+HALT
+d 4 4 3
+DOOP 3
+DOOP 30
+DOOP 5
+HALT
+EOF
+
+cat > $DIR/network.txt <<EOF
+3
+0 2 4
+2 0 3
+4 3 0
+0 1 0
+1 0 2
+0 2 0
+EOF
+
+CONFIGS=(
+	""
+	"--sched rr"
+	"--sched srtf"
+	"--sched mlfq --cores 2"
+	"--sched edf"
+	"--sched cfs --cores 2 --runqueue percore"
+	"--balance push --balance-period 5 --migration-cost 2"
+	"--balance pull"
+	"--lookahead"
+	"--network NETWORK --mailbox 2"
+	"--network NETWORK --lookahead --balance pull"
+	"--fuse"
+)
+TICKS="1 12 30 55"
+
+failed=0
+for name in "${CONFIGS[@]}"; do
+	config=${name//NETWORK/$DIR/network.txt}
+	$RUN --sequential $config < $DIR/input.txt > $DIR/full.txt 2>&1
+	for tick in $TICKS; do
+		run="${name:-default} at tick $tick"
+		rm -f $DIR/checkpoint
+		$RUN --sequential $config --checkpoint $DIR/checkpoint --checkpoint-at $tick \
+			< $DIR/input.txt > $DIR/saved.txt 2>&1
+		if [ $? -ne 0 ] || [ ! -f $DIR/checkpoint ]; then
+			echo "FAIL $run: no checkpoint written"
+			failed=1
+			continue
+		fi
+		if ! cmp -s $DIR/full.txt $DIR/saved.txt; then
+			echo "FAIL $run: taking the checkpoint changed the output"
+			failed=1
+			continue
+		fi
+		# The header of the checkpoint is the magic, the version, the number of nodes, the sync value
+		# and the tick before which the trace was written out
+		traced=$(od -An -t d8 -j 24 -N 8 $DIR/checkpoint | tr -d " ")
+		written=$(awk -v traced=$traced '/^\[[0-9]+\] [0-9]+: / && $2 + 0 < traced { n++; next } { exit } END { print n + 0 }' $DIR/full.txt)
+		$RUN --sequential --restore $DIR/checkpoint < /dev/null > $DIR/restored.txt 2>&1
+		status=$?
+		if [ $status -ne 0 ] || ! head -n $written $DIR/full.txt | cat - $DIR/restored.txt | cmp -s - $DIR/full.txt; then
+			echo "FAIL $run: the restored run is not the rest of the full run after line $written"
+			failed=1
+			continue
+		fi
+		echo "ok $run ($written of $(wc -l < $DIR/full.txt) lines before the checkpoint)"
+	done
+done
+
+# A damaged checkpoint must be refused, not crash the restored run. The first process record
+# starts at byte 48, after the header, the done flags and the number of processes. Its ip is at
+# byte 68 and its node at byte 108, and its first primitive at byte 216. The damage reads as an
+# out of range value in either byte order.
+$RUN --sequential --checkpoint $DIR/checkpoint --checkpoint-at 30 < $DIR/input.txt > /dev/null 2>&1
+for field in "ip 68" "node 108" "primitive 216"; do
+	set -- $field
+	cp $DIR/checkpoint $DIR/damaged
+	printf '\377\377\377\177' | dd of=$DIR/damaged bs=1 seek=$2 conv=notrunc status=none
+	$RUN --sequential --restore $DIR/damaged < /dev/null > $DIR/restored.txt 2>&1
+	status=$?
+	if [ $status -eq 0 ] || ! grep -q "is damaged" $DIR/restored.txt; then
+		echo "FAIL damaged $1: restore exited with $status"
+		failed=1
+		continue
+	fi
+	echo "ok damaged $1"
+done
+
+if [ $failed -ne 0 ]; then
+	echo Checkpoint round trip FAILED
+	exit 1
+fi
+echo Checkpoint round trip passed
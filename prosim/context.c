@@ -3,24 +3,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include "context.h"
+#include "loader.h"
 
-static const char *OPS [] = {"HALT", "DOOP", "LOOP", "END", "BLOCK", "SEND","RECV",NULL};
+static const char *OPS [] = {"HALT", "DOOP", "LOOP", "END", "BLOCK", "SEND","RECV","ASEND","BCAST","GATHER","BARRIER",NULL};
 
 
 #define PUSH(s,v) (*(s++) = v)
 #define POP(s) (*(--s))
 #define PEEK(s) (*(s - 1))
 
-/* Move the instruction pointer to the next DOOP, BLOCK or HALT to be executed.
+/* Reads in a program description and creates a context for it.
  * @params:
- *   cur: pointer to process context
+ *   in   : scanner at the program description
+ *   error: buffer of CONTEXT_ERROR_SIZE characters, receives the message if the description is bad
  * @returns:
- *   1 if DOOP or BLOCK is the next primitive.
- *   0 if HALT is the next primitive
- *   -1 is returned if an unknown primitive is encountered.
+ *   pointer to the new context or NULL if an error has occurred
  */
-extern real_priority *context_load(FILE *fin) {
+extern real_priority *context_parse(scanner_t *in, char *error) {
     /* Allocate new context and assume that it is successful,
      */
     real_priority *cur = calloc(1, sizeof(real_priority));
@@ -30,16 +31,20 @@ extern real_priority *context_load(FILE *fin) {
      * We assume it will be correct for the most part.
      */
     int size;
-    if (fscanf(fin, "%10s %d %d %d", cur->name, &size, &cur->priority, &cur->thread) < 4) {
-        fprintf(stderr, "Bad input: Expecting program name, size, priority, and thread\n");
+    if (!scan_word(in, cur->name, 10) || !scan_int(in, &size) || !scan_int(in, &cur->priority) ||
+        !scan_int(in, &cur->thread)) {
+        snprintf(error, CONTEXT_ERROR_SIZE, "Bad input: Expecting program name, size, priority, and thread\n");
         return NULL;
     }
+    cur->node = cur->thread;
+    cur->code_size = size;
 
     /* Allocate the primitive array and stack for the process.
      * We assume that the allocations will be successful.
      */
     cur->stack = malloc(2 * sizeof(int) * size);
     assert(cur->stack);
+    cur->stack_base = cur->stack;
 
     cur->code = malloc(size * sizeof(opcode));
     assert(cur->code);
@@ -55,9 +60,9 @@ extern real_priority *context_load(FILE *fin) {
 
         /* Since not all primitives have an argument, we have to read in the primitive first
          */
-        if (fscanf(fin, "%9s", op) < 1) {
-            fprintf(stderr, "Bad input: Expecting operation on line %d in %s\n",
-                    i + 1, cur->name);
+        if (!scan_word(in, op, 9)) {
+            snprintf(error, CONTEXT_ERROR_SIZE, "Bad input: Expecting operation on line %d in %s\n",
+                     i + 1, cur->name);
             return NULL;
         }
 
@@ -70,10 +75,10 @@ extern real_priority *context_load(FILE *fin) {
         for (int j = 0; OPS[j]; j++) {
             if (!strcmp(op, OPS[j])) {
                 cur->code[i].op = j;
-                if (j == OP_LOOP || j == OP_DOOP || j == OP_BLOCK || j==OP_SEND || j==OP_RECV) {
-                    if (fscanf(fin, "%d", &cur->code[i].arg) < 1) {
-                        fprintf(stderr, "Bad input: Expecting argument to op on line %d in %s\n",
-                                i + 1, cur->name);
+                if (j == OP_LOOP || j == OP_DOOP || j == OP_BLOCK || context_is_message_op(j)) {
+                    if (!scan_long(in, &cur->code[i].arg)) {
+                        snprintf(error, CONTEXT_ERROR_SIZE, "Bad input: Expecting argument to op on line %d in %s\n",
+                                 i + 1, cur->name);
                         return NULL;
                     }
                 }
@@ -84,7 +89,7 @@ extern real_priority *context_load(FILE *fin) {
         /* This is what happens if the Opcode is unknown.
          */
         if (cur->code[i].op == -1) {
-            fprintf(stderr, "Bad input: operation %d unknown: %s\n", i + 1, op);
+            snprintf(error, CONTEXT_ERROR_SIZE, "Bad input: operation %d unknown: %s\n", i + 1, op);
             return NULL;
         }
     }
@@ -110,14 +115,13 @@ extern int context_next_op(real_priority *cur) {
         cur->ip++;
         switch (cur->code[cur->ip].op) {
             case OP_LOOP:
-                /* Use a stack to keep track of nested loops by pushing
-                 * the start of loop and number of iterations on the stack.
+                /* Use a stack to keep track of nested loops by pushing the number of
+                 * iterations on the stack. The END of the loop knows where the loop starts.
                  */
-                PUSH(cur->stack, cur->ip);
                 PUSH(cur->stack, cur->code[cur->ip].arg);
                 break;
             case OP_DOOP:
-                cur->doop_count++;
+                cur->doop_count += cur->code[cur->ip].count;
                 cur->doop_time += cur->code[cur->ip].arg;
                 return 1;
             case OP_BLOCK:
@@ -126,6 +130,7 @@ extern int context_next_op(real_priority *cur) {
                 return 1;
 
             case OP_SEND:
+            case OP_ASEND:
                 cur->send_count++;
                 return 1;
 
@@ -133,22 +138,29 @@ extern int context_next_op(real_priority *cur) {
                 cur->recv_count++;
                 return 1;
 
+            case OP_BCAST:
+            case OP_GATHER:
+            case OP_BARRIER:
+                /* Whether a collective sends or receives depends on the group,
+                 * so the message system counts it.
+                 */
+                return 1;
+
             case OP_END:
                 /* The top of stack contains current loop info.
                  * Number of iterations is one-less now.
                  */
-                count = POP(cur->stack);
-                count--;
+                count = PEEK(cur->stack) - 1;
                 if (count == 0) {
                     /* Stack needs to be cleared if the loop is done.
                      */
                     POP(cur->stack);
                 } else {
                     /* Stack needs to be updated with new count and
-                     * ip moved to start of loop body.
+                     * ip moved to the LOOP, just before the loop body.
                      */
-                    cur->ip = PEEK(cur->stack);
-                    PUSH(cur->stack, count);
+                    PEEK(cur->stack) = count;
+                    cur->ip = cur->code[cur->ip].target;
                 }
                 break;
             case OP_HALT:
@@ -160,13 +172,158 @@ extern int context_next_op(real_priority *cur) {
     }
 }
 
+/* Finds the next DOOP, BLOCK or HALT to be executed without moving the instruction pointer.
+ * The loop stack and the statistics are left as they were, so the primitive is only counted
+ * once context_next_op moves to it.
+ * @params:
+ *   cur: pointer to process context
+ * @returns:
+ *   the value context_next_op would return
+ */
+extern int context_peek_op(real_priority *cur) {
+    int saved_ip = cur->ip;
+    int *saved_stack = cur->stack;
+    int doop_count = cur->doop_count;
+    long long doop_time = cur->doop_time;
+    int block_count = cur->block_count;
+    long long block_time = cur->block_time;
+    int send_count = cur->send_count;
+    int recv_count = cur->recv_count;
+
+    /* Passing an END rewrites the iteration count of its loop in place,
+     * so the part of the stack in use is saved as well as the stack pointer.
+     */
+    int depth = saved_stack - cur->stack_base;
+    int buffer[32];
+    int *saved = depth <= 32 ? buffer : malloc(depth * sizeof(int));
+    assert(saved);
+    memcpy(saved, cur->stack_base, depth * sizeof(int));
+
+    int res = context_next_op(cur);
+
+    cur->ip = saved_ip;
+    cur->stack = saved_stack;
+    cur->doop_count = doop_count;
+    cur->doop_time = doop_time;
+    cur->block_count = block_count;
+    cur->block_time = block_time;
+    cur->send_count = send_count;
+    cur->recv_count = recv_count;
+    memcpy(cur->stack_base, saved, depth * sizeof(int));
+    if (saved != buffer) {
+        free(saved);
+    }
+    return res;
+}
+
+/* Returns true if a primitive is a DOOP that can be fused with another one.
+ * @params:
+ *   code: pointer to the primitive
+ * @returns:
+ *   1 if the primitive is a DOOP of positive length, 0 otherwise
+ */
+static int fusable(const opcode *code) {
+    return code->op == OP_DOOP && code->arg > 0;
+}
+
+/* Adds the length and DOOP count of a fusable DOOP to another one, unless either would overflow.
+ * @params:
+ *   into : pointer to the DOOP to extend
+ *   arg  : length to add
+ *   count: number of DOOPs to add
+ * @returns:
+ *   1 if the DOOPs were fused, 0 otherwise
+ */
+static int fuse_doop(opcode *into, long long arg, int count) {
+    if (into->arg > LLONG_MAX - arg || into->count > INT_MAX - count) {
+        return 0;
+    }
+    into->arg += arg;
+    into->count += count;
+    return 1;
+}
+
+/* Compiles the program of a loaded process in place.
+ * @params:
+ *   cur  : pointer to process context, as read by context_parse
+ *   fuse : 1 to fuse DOOPs, 0 to keep every primitive
+ *   error: buffer of CONTEXT_ERROR_SIZE characters, receives the message if the program is bad
+ * @returns:
+ *   1 on success, 0 if an END has no LOOP
+ */
+extern int context_compile(real_priority *cur, int fuse, char *error) {
+    /* The compiled program is written over the input one, which is never shorter.
+     * loops holds the index in the compiled program of every LOOP not yet closed.
+     */
+    int *loops = malloc((cur->code_size + 1) * sizeof(int));
+    assert(loops);
+    int depth = 0;
+    int size = 0;
+
+    for (int i = 0; i < cur->code_size; i++) {
+        opcode code = cur->code[i];
+        code.target = -1;
+        if (code.op == OP_DOOP) {
+            code.count = 1;
+            if (fuse && fusable(&code) && size > 0 && fusable(&cur->code[size - 1]) &&
+                fuse_doop(&cur->code[size - 1], code.arg, code.count)) {
+                continue;
+            }
+        } else if (code.op == OP_LOOP) {
+            loops[depth++] = size;
+        } else if (code.op == OP_END) {
+            if (depth == 0) {
+                snprintf(error, CONTEXT_ERROR_SIZE, "Bad input: END on line %d in %s has no LOOP\n", i + 1, cur->name);
+                free(loops);
+                return 0;
+            }
+            int start = loops[--depth];
+            opcode *loop = &cur->code[start];
+            opcode *body = &cur->code[start + 1];
+
+            /* A loop around a single DOOP is one DOOP as long as all its iterations.
+             * It then goes through the same fusion as any other DOOP.
+             */
+            if (fuse && size == start + 2 && loop->arg > 0 && fusable(body) &&
+                body->arg <= LLONG_MAX / loop->arg && body->count <= INT_MAX / loop->arg) {
+                code.op = OP_DOOP;
+                code.arg = body->arg * loop->arg;
+                code.count = body->count * (int)loop->arg;
+                size = start;
+                if (size > 0 && fusable(&cur->code[size - 1]) && fuse_doop(&cur->code[size - 1], code.arg, code.count)) {
+                    continue;
+                }
+            } else {
+                loop->target = size;
+                code.target = start;
+            }
+        }
+        cur->code[size++] = code;
+    }
+
+    free(loops);
+    cur->code_size = size;
+    return 1;
+}
+
 /* returns the duration of the current primitive.
  * @params:
  *   cur: pointer to process context
  * @returns:
  *   number of clock ticks of the current primitive,
  */
-extern int context_cur_duration(real_priority *cur) {
+extern long long context_cur_duration(real_priority *cur) {
+    assert(cur->ip >= 0);
+    return cur->code[cur->ip].arg;
+}
+
+/* returns the address argument of the current SEND, ASEND or RECV primitive.
+ * @params:
+ *   cur: pointer to process context
+ * @returns:
+ *   address of the process to send to or receive from
+ */
+extern long long context_cur_address(real_priority *cur) {
     assert(cur->ip >= 0);
     return cur->code[cur->ip].arg;
 }
@@ -190,9 +347,78 @@ extern int context_cur_op(real_priority *cur) {
  *   none
  */
 extern void context_stats(real_priority *cur, FILE *fout) {
-    fprintf(fout,"| %5.5d | Proc %2.2d.%2.2d | Run %d, Block %d, Wait %d, Sends %d, Recvs %d\n",
+    fprintf(fout,"| %5.5lld | Proc %2.2d.%2.2d | Run %lld, Block %lld, Wait %lld, Sends %d, Recvs %d\n",
          cur->finished, cur->thread, cur->id,
          cur->doop_time, cur->block_time, cur->wait_time,
          cur->send_count, cur->recv_count);
 }
 
+
+/* Returns true if the primitive sends or receives: SEND, ASEND, RECV or one of the collectives.
+ * @params:
+ *   op: primitive op code
+ * @returns:
+ *   1 if the primitive is a message primitive, 0 otherwise
+ */
+extern int context_is_message_op(int op) {
+    return op == OP_SEND || op == OP_ASEND || op == OP_RECV ||
+           op == OP_BCAST || op == OP_GATHER || op == OP_BARRIER;
+}
+
+/* Returns true if the body of a loop contains a message primitive, including in nested loops.
+ * @params:
+ *   cur: pointer to process context
+ *   end: index of the END of the loop
+ * @returns:
+ *   1 if the body sends or receives, 0 otherwise
+ */
+static int loop_has_message(real_priority *cur, int end) {
+    for (int ip = cur->code[end].target + 1; ip < end; ip++) {
+        if (context_is_message_op(cur->code[ip].op)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns a lower bound on the number of clock ticks from the end of the current primitive
+ * until the process has completed its next SEND or RECV.
+ * DOOPs and BLOCKs on the way count their full length. The scan goes past the end of a loop
+ * whose body has no SEND or RECV, and stops at the end of one that has, since repeating the
+ * body can only take longer than what has been counted so far.
+ * @params:
+ *   cur: pointer to process context
+ * @returns:
+ *   lower bound on ticks, or LLONG_MAX if the process halts before sending or receiving again
+ */
+extern long long context_message_distance(real_priority *cur) {
+    long long ticks = 0;
+
+    for (int ip = cur->ip + 1; ticks < LLONG_MAX; ip++) {
+        switch (cur->code[ip].op) {
+            case OP_DOOP:
+            case OP_BLOCK:
+                if (cur->code[ip].arg > 0) {
+                    ticks += cur->code[ip].arg;
+                }
+                break;
+            case OP_SEND:
+            case OP_ASEND:
+            case OP_RECV:
+            case OP_BCAST:
+            case OP_GATHER:
+            case OP_BARRIER:
+                return ticks + 1 < LLONG_MAX ? ticks + 1 : LLONG_MAX;
+            case OP_LOOP:
+                break;
+            case OP_END:
+                if (loop_has_message(cur, ip)) {
+                    return ticks;
+                }
+                break;
+            default:
+                return LLONG_MAX;
+        }
+    }
+    return LLONG_MAX;
+}
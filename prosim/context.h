@@ -3,35 +3,57 @@
 #define ASSIGNMENT_1_CONTEXT_H
 
 #include <stdio.h>
+#include "prio_q.h"
+
+#define CONTEXT_ERROR_SIZE 128
+
+struct scanner;
+
 enum {
-    OP_HALT, OP_DOOP, OP_LOOP, OP_END, OP_BLOCK, OP_SEND,OP_RECV,OP_LAST
+    OP_HALT, OP_DOOP, OP_LOOP, OP_END, OP_BLOCK, OP_SEND,OP_RECV,OP_ASEND,OP_BCAST,OP_GATHER,OP_BARRIER,OP_LAST
 };
 
 typedef struct opcode {
     int op;                     /* primitive op code (see enum above) */
-    int arg;                    /* argument value associated with the op code */
+    union {
+        int target;             /* LOOP and END: index of the matching END or LOOP, set by context_compile */
+        int count;              /* DOOP: number of DOOPs of the input it stands for, more than 1 once fused */
+    };
+    long long arg;              /* argument value associated with the op code, an address for SEND and RECV,
+                                   the root address for BCAST and GATHER and a group number for BARRIER */
 } opcode;
 
 typedef struct context {
     opcode *code;               /* array of primitives */
-    int *stack;                 /* stack for processing loops */
+    int *stack;                 /* iterations left in each loop being run, innermost on top */
+    int *stack_base;            /* bottom of the loop stack */
     char name[11];              /* program name */
     int ip;                     /* index of current primitive being executed */
     int id;                     /* process id */
     int priority;               /* process priority */
-    int duration;               /* amount of clock ticks left in current primitive */
+    long long duration;         /* amount of clock ticks left in current primitive, or wake-up time while blocked */
     int state;                  /* current state of process: NEW, READY, RUNNING, BLOCKED, FINISHED */
-    int enqueue_time;           /* time at which process was added to ready queue */
+    long long enqueue_time;     /* time at which process was added to ready queue */
     int doop_count;             /* number of DOOPs performed */
-    int doop_time;              /* number of clock ticks spent executing DOOPs*/
+    long long doop_time;        /* number of clock ticks spent executing DOOPs*/
     int block_count;            /* number of BLOCKs performed */
-    int block_time;             /* number of clock ticks spent being blocked */
-    int wait_count;             /* number of times process is added to the ready queue */
-    int wait_time;              /* number of clock ticks spent waiting in ready queue */
+    long long block_time;       /* number of clock ticks spent being blocked */
+    long long wait_time;        /* number of clock ticks spent waiting in ready queue */
     int thread;                 /* node id to which process is to be assigned */
-    int finished;               /* time process finished */
+    long long finished;         /* time process finished */
     int send_count;
     int recv_count;
+    node_t link;                /* queue link, a process is in at most one ready, blocked or finished queue */
+    struct context *msg_next;   /* inbox link, used while a matched process waits for its node */
+    long long msg_arrival;      /* tick at which the message releasing the process reaches its node */
+    int sched_level;            /* level of the process in a multi-level scheduling policy */
+    long long vruntime;         /* virtual runtime of the process in a fair scheduling policy */
+    int node;                   /* node id on which the process currently runs, thread unless it migrated */
+    int code_size;              /* number of primitives in code */
+    int index;                  /* position of the process in the input, names it in checkpoints */
+    long long arrival;          /* tick at which the process was admitted */
+    int dispatch_count;         /* number of times the process was dispatched on a core */
+    long long block_start;      /* tick at which the process blocked on its current message primitive */
 
 
 } real_priority;
@@ -46,13 +68,39 @@ typedef struct context {
  */
 extern int context_next_op(real_priority *cur);
 
-/* Reads in a program description from a file and creates a context for it.
+/* Finds the next DOOP, BLOCK or HALT to be executed without moving the instruction pointer.
+ * The loop stack and the statistics are left as they were, so the primitive is only counted
+ * once context_next_op moves to it.
  * @params:
- *   fin: FILE from which to read
+ *   cur: pointer to process context
+ * @returns:
+ *   the value context_next_op would return
+ */
+extern int context_peek_op(real_priority *cur);
+
+/* Reads in a program description and creates a context for it.
+ * @params:
+ *   in   : scanner at the program description
+ *   error: buffer of CONTEXT_ERROR_SIZE characters, receives the message if the description is bad
  * @returns:
  *   pointer to the new context or NULL if an error has occurred
  */
-extern real_priority *context_load(FILE *fin);
+extern real_priority *context_parse(struct scanner *in, char *error);
+
+/* Compiles the program of a loaded process in place.
+ * Every LOOP and END gets the index of its partner, so passing an END is a jump and the loop stack
+ * only holds iteration counts. With fusion, adjacent DOOPs become one DOOP of their total length,
+ * and a loop whose body comes down to a single DOOP becomes one DOOP as long as all its iterations,
+ * which the node then runs in one stretch. A fused DOOP still counts every DOOP it stands for in
+ * the statistics, but the process is enqueued, scheduled and traced once for it.
+ * @params:
+ *   cur  : pointer to process context, as read by context_parse
+ *   fuse : 1 to fuse DOOPs, 0 to keep every primitive
+ *   error: buffer of CONTEXT_ERROR_SIZE characters, receives the message if the program is bad
+ * @returns:
+ *   1 on success, 0 if an END has no LOOP
+ */
+extern int context_compile(real_priority *cur, int fuse, char *error);
 
 /* Outputs aggregate statistics about a process to the specified file.
  * @params:
@@ -69,7 +117,15 @@ extern void context_stats(real_priority *cur, FILE *fout);
  * @returns:
  *   number of clock ticks of the current primitive,
  */
-extern int context_cur_duration(real_priority *cur);
+extern long long context_cur_duration(real_priority *cur);
+
+/* returns the address argument of the current SEND, ASEND or RECV primitive.
+ * @params:
+ *   cur: pointer to process context
+ * @returns:
+ *   address of the process to send to or receive from
+ */
+extern long long context_cur_address(real_priority *cur);
 
 /* Returns the current primitive being executed
  * @params:
@@ -79,5 +135,24 @@ extern int context_cur_duration(real_priority *cur);
  */
 extern int context_cur_op(real_priority *cur);
 
+/* Returns a lower bound on the number of clock ticks from the end of the current primitive
+ * until the process has completed its next SEND or RECV.
+ * DOOPs and BLOCKs on the way count their full length. The scan goes past the end of a loop
+ * whose body has no SEND or RECV, and stops at the end of one that has, since repeating the
+ * body can only take longer than what has been counted so far.
+ * @params:
+ *   cur: pointer to process context
+ * @returns:
+ *   lower bound on ticks, or LLONG_MAX if the process halts before sending or receiving again
+ */
+extern long long context_message_distance(real_priority *cur);
+
+/* Returns true if the primitive sends or receives: SEND, ASEND, RECV or one of the collectives.
+ * @params:
+ *   op: primitive op code
+ * @returns:
+ *   1 if the primitive is a message primitive, 0 otherwise
+ */
+extern int context_is_message_op(int op);
 
 #endif //ASSIGNMENT_1_CONTEXT_H
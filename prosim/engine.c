@@ -0,0 +1,412 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "engine.h"
+#include "barrier.h"
+#include "balance.h"
+#include "checkpoint.h"
+#include "message.h"
+
+/* The nodes are multiplexed onto a fixed pool of worker threads.
+ * The simulation goes in rounds: in each round every active node takes one step (see process_step),
+ * then the workers meet at the barrier, which also computes the minimum of the values the steps
+ * returned. That minimum is what every node resumes from in the next round.
+ * Each worker owns a contiguous range of nodes and claims them one at a time from its own cursor.
+ * A worker that runs out steals from the cursors of the others, so a few slow nodes do not hold up
+ * the round. Cursors are reset for the next round before the barrier, and rounds alternate between
+ * two sets of cursors so the reset never races with claims of the round in progress.
+ * With a balancer or a checkpoint to take, the first worker through the barrier balances the nodes and
+ * writes the checkpoint while the others wait at a second barrier, which hands out the tick to resume
+ * from once processes have moved. The first worker also writes out the trace the nodes recorded this
+ * way, after every round when it pauses them anyway and every TRACE_ROUNDS rounds otherwise.
+ */
+#define CACHE_LINE 64
+#define CHECKPOINT_MAGIC "PROSIMCK"
+#define CHECKPOINT_VERSION 9
+#define TRACE_ROUNDS 64
+
+/* Header of a checkpoint, followed by the done flag of every node, the processes (see checkpoint.h),
+ * and the state of the process, message and balance modules.
+ */
+typedef struct {
+    char magic[8];
+    int version;
+    int num_nodes;
+    long long sync;             /* value the nodes resume their next step from */
+    long long traced;           /* tick before which the run wrote out its trace, where the restored trace starts */
+} engine_record;
+
+/* Checkpoint to take, see engine_checkpoint
+ */
+static const char *checkpoint_path = NULL;
+static long long checkpoint_tick;
+static real_priority **checkpoint_procs;
+static int checkpoint_num_procs;
+static int checkpoint_written = 0;
+
+/* State restored by engine_restore, that the next run resumes from
+ */
+static long long resume_sync = 0;
+static char *resume_done = NULL;
+
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic int next;  /* next node to claim in the worker's range */
+} claim_cursor;
+
+typedef struct {
+    processor_t **cpus;
+    int num_nodes;
+    int workers;
+    int *range;                 /* worker w owns nodes range[w] to range[w + 1] - 1 */
+    claim_cursor *cursors[2];   /* one cursor per worker, for even and odd rounds */
+    char *done;                 /* 1 once a node has nothing left to do, written by its stepper or the balancer */
+    _Atomic int active;         /* number of nodes not done */
+    const balancer_t *balancer; /* moves processes between nodes after each round, or NULL */
+    int pause;                  /* 1 if the first worker has work to do between every two rounds */
+    long long start;            /* value the first round resumes from */
+} engine_t;
+
+typedef struct {
+    engine_t *engine;
+    int id;
+} worker_args;
+
+/***
+*Claims the next node of a round from the given worker's range, or returns -1 if it is exhausted
+*/
+static int engine_claim(engine_t *engine, claim_cursor *cursors, int owner) {
+    if (atomic_load_explicit(&cursors[owner].next, memory_order_relaxed) >= engine->range[owner + 1]) {
+        return -1;
+    }
+    int node = atomic_fetch_add(&cursors[owner].next, 1);
+    return node < engine->range[owner + 1] ? node : -1;
+}
+/***
+*Steps a node for one round and folds the value it synchronizes on into the minimum
+*/
+static void engine_step(engine_t *engine, int node, long long sync, long long *minimum) {
+    if (engine->done[node]) {
+        return;
+    }
+
+    long long value = LLONG_MAX;
+    if (process_step(engine->cpus[node], sync, &value)) {
+        if (value < *minimum) {
+            *minimum = value;
+        }
+    } else {
+        engine->done[node] = 1;
+        atomic_fetch_sub(&engine->active, 1);
+    }
+}
+/***
+*Runs the balancer between two rounds and brings back the nodes that were done and were given processes
+*Nodes that took part in a migration have to simulate the next tick to report their next event again,
+*so the tick to resume from is pulled in to it.
+*Returns the number of nodes brought back
+*/
+static int engine_balance(const balancer_t *balancer, processor_t **cpus, int num_nodes, char *done, long long *sync) {
+    long long now = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        if (cpus[i]->clock_time > now) {
+            now = cpus[i]->clock_time;
+        }
+    }
+    if (balancer->balance(cpus, num_nodes, now) == 0) {
+        return 0;
+    }
+
+    if (now + 1 < *sync) {
+        *sync = now + 1;
+    }
+    int revived = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        if (done[i] && process_load(cpus[i]) > 0) {
+            done[i] = 0;
+            revived++;
+        }
+    }
+    return revived;
+}
+/***
+*Writes out the trace up to the tick the earliest node is at
+*A node only records events from the tick after its clock on, and nodes that are done record none,
+*so no event can come in before the ones written out.
+*Returns the tick before which the trace is written out
+*/
+static long long engine_trace(processor_t **cpus, int num_nodes, const char *done) {
+    long long upto = LLONG_MAX;
+    for (int i = 0; i < num_nodes; i++) {
+        if (!done[i] && cpus[i]->clock_time < upto) {
+            upto = cpus[i]->clock_time + 1;
+        }
+    }
+    process_trace(cpus, num_nodes, upto, stdout);
+    return upto;
+}
+/***
+*Writes the checkpoint once the nodes are past its tick, unless they are all done by then
+*The trace must have just been written out up to the given tick.
+*/
+static void engine_snapshot(processor_t **cpus, int num_nodes, const balancer_t *balancer,
+                            const char *done, long long sync, long long traced, int active) {
+    if (checkpoint_path == NULL || active == 0 || sync <= checkpoint_tick) {
+        return;
+    }
+
+    checkpoint_t *ck = checkpoint_create(checkpoint_path);
+    checkpoint_path = NULL;
+    if (ck == NULL) {
+        return;
+    }
+    engine_record header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.num_nodes = num_nodes;
+    header.sync = sync;
+    header.traced = traced;
+    checkpoint_put(ck, &header, sizeof(header));
+    checkpoint_put(ck, done, num_nodes);
+    checkpoint_save_procs(ck, checkpoint_procs, checkpoint_num_procs);
+    process_save(ck, cpus, num_nodes);
+    message_save(ck);
+    balance_save(ck, balancer);
+    checkpoint_written = checkpoint_commit(ck);
+}
+/***
+*Worker loop: claims and steps nodes round after round until every node is done
+*/
+static void *engine_worker(void *arg) {
+    worker_args *args = arg;
+    engine_t *engine = args->engine;
+    int id = args->id;
+
+    long long sync = engine->start;
+    for (int round = 0; ; round++) {
+        claim_cursor *cursors = engine->cursors[round & 1];
+        long long minimum = LLONG_MAX;
+        int node;
+
+        while ((node = engine_claim(engine, cursors, id)) >= 0) {
+            engine_step(engine, node, sync, &minimum);
+        }
+        for (int i = 1; i < engine->workers; i++) {
+            int victim = (id + i) % engine->workers;
+            while ((node = engine_claim(engine, cursors, victim)) >= 0) {
+                engine_step(engine, node, sync, &minimum);
+            }
+        }
+
+        /* Every claim of the previous round happened before this round's barrier was passed,
+         * so that round's cursors are free to reset for the next one.
+         */
+        atomic_store(&engine->cursors[(round + 1) & 1][id].next, engine->range[id]);
+        sync = barrier_wait_next(minimum);
+        if (engine->pause || round % TRACE_ROUNDS == TRACE_ROUNDS - 1) {
+            long long resume = LLONG_MAX;
+            if (id == 0) {
+                resume = sync;
+                if (engine->balancer != NULL) {
+                    int revived = engine_balance(engine->balancer, engine->cpus, engine->num_nodes,
+                                                 engine->done, &resume);
+                    atomic_fetch_add(&engine->active, revived);
+                }
+                long long traced = engine_trace(engine->cpus, engine->num_nodes, engine->done);
+                engine_snapshot(engine->cpus, engine->num_nodes, engine->balancer, engine->done,
+                                resume, traced, atomic_load(&engine->active));
+            }
+            sync = barrier_wait_next(resume);
+        }
+
+        /* Nodes only finish while stepping, so once none are active the count stays at zero.
+         * A worker that sees it early while the others are already in the next round leaves
+         * the barrier, which lets them through it.
+         */
+        if (atomic_load(&engine->active) == 0) {
+            break;
+        }
+    }
+
+    complete_barrier();
+    return NULL;
+}
+/***
+*Copies the done flags restored from a checkpoint, if any, and returns the number of active nodes
+*/
+static int engine_resume(char *done, int num_nodes) {
+    int active = num_nodes;
+    if (resume_done != NULL) {
+        memcpy(done, resume_done, num_nodes);
+        for (int i = 0; i < num_nodes; i++) {
+            active -= done[i] != 0;
+        }
+    }
+    return active;
+}
+/***
+*Runs the simulation of all nodes on the worker pool and returns once every node is done
+*/
+extern void engine_run(processor_t **cpus, int num_nodes, int workers, const balancer_t *balancer) {
+    assert(workers > 0 && workers <= num_nodes);
+
+    engine_t engine;
+    engine.cpus = cpus;
+    engine.num_nodes = num_nodes;
+    engine.workers = workers;
+    engine.balancer = balancer;
+    engine.pause = balancer != NULL || checkpoint_path != NULL;
+    engine.start = resume_sync;
+    engine.range = malloc((workers + 1) * sizeof(int));
+    engine.done = calloc(num_nodes, sizeof(char));
+    assert(engine.range && engine.done);
+    atomic_init(&engine.active, engine_resume(engine.done, num_nodes));
+
+    for (int w = 0; w <= workers; w++) {
+        engine.range[w] = (int)((long long)w * num_nodes / workers);
+    }
+    for (int i = 0; i < 2; i++) {
+        engine.cursors[i] = aligned_alloc(CACHE_LINE, workers * sizeof(claim_cursor));
+        assert(engine.cursors[i]);
+        for (int w = 0; w < workers; w++) {
+            atomic_init(&engine.cursors[i][w].next, engine.range[w]);
+        }
+    }
+
+    create_barrier(workers);
+
+    /* Create the workers and assume creation will be successful (or just die)
+     */
+    pthread_t *tid = calloc(workers, sizeof(pthread_t));
+    worker_args *args = calloc(workers, sizeof(worker_args));
+    assert(tid && args);
+    for (int w = 0; w < workers; w++) {
+        args[w].engine = &engine;
+        args[w].id = w;
+        int result = pthread_create(&tid[w], NULL, engine_worker, &args[w]);
+        assert(result == 0);
+    }
+    for (int w = 0; w < workers; w++) {
+        int result = pthread_join(tid[w], NULL);
+        assert(result == 0);
+    }
+    process_trace(cpus, num_nodes, LLONG_MAX, stdout);
+
+    free(tid);
+    free(args);
+    free(engine.cursors[0]);
+    free(engine.cursors[1]);
+    free(engine.done);
+    free(engine.range);
+}
+/***
+*Runs the simulation of all nodes on the calling thread and returns once every node is done
+*Nodes step in node order within each round, so the trace only depends on the input.
+*/
+extern void engine_run_sequential(processor_t **cpus, int num_nodes, const balancer_t *balancer) {
+    char *done = calloc(num_nodes, sizeof(char));
+    assert(done);
+
+    int active = engine_resume(done, num_nodes);
+    long long sync = resume_sync;
+    for (int round = 0; active > 0; round++) {
+        long long minimum = LLONG_MAX;
+        for (int node = 0; node < num_nodes; node++) {
+            if (done[node]) {
+                continue;
+            }
+
+            long long value = LLONG_MAX;
+            if (process_step(cpus[node], sync, &value)) {
+                if (value < minimum) {
+                    minimum = value;
+                }
+            } else {
+                done[node] = 1;
+                active--;
+            }
+        }
+        sync = minimum;
+        if (balancer != NULL) {
+            active += engine_balance(balancer, cpus, num_nodes, done, &sync);
+        }
+        if (checkpoint_path != NULL || round % TRACE_ROUNDS == TRACE_ROUNDS - 1) {
+            long long traced = engine_trace(cpus, num_nodes, done);
+            engine_snapshot(cpus, num_nodes, balancer, done, sync, traced, active);
+        }
+    }
+    process_trace(cpus, num_nodes, LLONG_MAX, stdout);
+    free(done);
+}
+/***
+*Returns the number of processors online, capped at the number of nodes
+*/
+extern int engine_default_workers(int num_nodes) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    return cpus < num_nodes ? (int)cpus : num_nodes;
+}
+/***
+*Arranges for the next run to write a checkpoint once every node is past the given tick
+*/
+extern void engine_checkpoint(const char *path, long long tick, real_priority **procs, int num_procs) {
+    checkpoint_path = path;
+    checkpoint_tick = tick;
+    checkpoint_procs = procs;
+    checkpoint_num_procs = num_procs;
+    checkpoint_written = 0;
+}
+/***
+*Tells whether the checkpoint arranged for was written, and why not if it was not
+*/
+extern int engine_checkpoint_done(void) {
+    if (checkpoint_path != NULL) {
+        fprintf(stderr, "Bad checkpoint, the run ended by tick %lld, %s was not written\n",
+                checkpoint_tick, checkpoint_path);
+        checkpoint_path = NULL;
+    }
+    return checkpoint_written;
+}
+/***
+*Restores a simulation from a checkpoint, for the next run to resume from
+*/
+extern int engine_restore(const char *path, real_priority ***procs, int *num_procs,
+                          processor_t ***cpus, int *num_nodes, const balancer_t **balancer) {
+    checkpoint_t *ck = checkpoint_open(path);
+    if (ck == NULL) {
+        return 0;
+    }
+
+    const engine_record *header = checkpoint_get(ck, sizeof(engine_record));
+    if (!header || memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) ||
+        header->version != CHECKPOINT_VERSION) {
+        fprintf(stderr, "Bad checkpoint, %s is not a checkpoint of this version\n", path);
+        return 0;
+    }
+
+    const char *done = header->num_nodes > 0 ? checkpoint_get(ck, header->num_nodes) : NULL;
+    processor_t **nodes = calloc(header->num_nodes > 0 ? header->num_nodes : 1, sizeof(processor_t *));
+    assert(nodes);
+    if (!done || !checkpoint_restore_procs(ck) || !process_restore(ck, nodes, header->num_nodes) ||
+        !message_restore(ck) || !balance_restore(ck, balancer)) {
+        fprintf(stderr, "Bad checkpoint, %s is damaged\n", path);
+        return 0;
+    }
+
+    resume_sync = header->sync;
+    resume_done = malloc(header->num_nodes);
+    assert(resume_done);
+    memcpy(resume_done, done, header->num_nodes);
+    *procs = ck->procs;
+    *num_procs = ck->num_procs;
+    *cpus = nodes;
+    *num_nodes = header->num_nodes;
+    free(ck);
+    return 1;
+}
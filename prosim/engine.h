@@ -0,0 +1,75 @@
+//
+// Runs the simulated nodes on a pool of worker threads.
+//
+
+#ifndef PROSIM_ENGINE_H
+#define PROSIM_ENGINE_H
+#include "process.h"
+#include "balance.h"
+
+/* Simulate a set of nodes on a fixed number of worker threads
+ * @params:
+ *   cpus     : node contexts, with their processes admitted
+ *   num_nodes: number of nodes
+ *   workers  : number of worker threads, at most num_nodes
+ *   balancer : balancer to run between rounds, or NULL to keep processes on their nodes
+ * @returns:
+ *   none
+ */
+extern void engine_run(processor_t **cpus, int num_nodes, int workers, const balancer_t *balancer);
+
+/* Simulate a set of nodes on the calling thread, stepping them in node order
+ * @params:
+ *   cpus     : node contexts, with their processes admitted
+ *   num_nodes: number of nodes
+ *   balancer : balancer to run between rounds, or NULL to keep processes on their nodes
+ * @returns:
+ *   none
+ */
+extern void engine_run_sequential(processor_t **cpus, int num_nodes, const balancer_t *balancer);
+
+/* Returns the default number of worker threads: one per processor, but no more than there are nodes
+ * @params:
+ *   num_nodes: number of nodes
+ * @returns:
+ *   number of worker threads
+ */
+extern int engine_default_workers(int num_nodes);
+
+/* Arrange for the next run to write a checkpoint at the first synchronization after the given tick,
+ * once every node has simulated the tick. Nothing is written if the nodes are all done by then,
+ * which engine_checkpoint_done reports.
+ * @params:
+ *   path     : file to write, replaced only once the checkpoint is complete
+ *   tick     : tick the nodes must be past
+ *   procs    : every process, by index
+ *   num_procs: number of processes
+ * @returns:
+ *   none
+ */
+extern void engine_checkpoint(const char *path, long long tick, real_priority **procs, int num_procs);
+
+/* Tells whether the checkpoint arranged for by engine_checkpoint was written by the last run
+ * @params:
+ *   none
+ * @returns:
+ *   1 if it was written, or prints an error and returns 0, for instance if the run ended before its tick
+ */
+extern int engine_checkpoint_done(void);
+
+/* Restore a simulation from a checkpoint. The process, message and balance modules are set up with
+ * the settings of the checkpointed run, and the next run resumes where it stopped.
+ * @params:
+ *   path     : file to read
+ *   procs    : where to store the array of processes, by index
+ *   num_procs: where to store the number of processes
+ *   cpus     : where to store the array of node contexts
+ *   num_nodes: where to store the number of nodes
+ *   balancer : where to store the balancer of the run, NULL if there was none
+ * @returns:
+ *   1 on success, or prints an error and returns 0
+ */
+extern int engine_restore(const char *path, real_priority ***procs, int *num_procs,
+                          processor_t ***cpus, int *num_nodes, const balancer_t **balancer);
+
+#endif //PROSIM_ENGINE_H
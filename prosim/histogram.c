@@ -0,0 +1,147 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "histogram.h"
+#include "checkpoint.h"
+
+/* Saved histogram, followed by its counts
+ */
+typedef struct {
+    long long count;
+    long long sum;
+    long long min;
+    long long max;
+    int size;
+} saved_histogram;
+
+/* Returns the bucket of a value
+ * Values from 2^k to 2^(k+1) - 1, for k at least HISTOGRAM_BITS, share HISTOGRAM_SUB / 2 buckets
+ * placed after the ones of 2^(k-1).
+ */
+static int bucket_of(long long value) {
+    if (value < HISTOGRAM_SUB) {
+        return value;
+    }
+    int k = 63 - __builtin_clzll((unsigned long long)value);
+    int shift = k - HISTOGRAM_BITS + 1;
+    return HISTOGRAM_SUB + (k - HISTOGRAM_BITS) * (HISTOGRAM_SUB / 2) + (int)(value >> shift) - HISTOGRAM_SUB / 2;
+}
+
+/* Returns the largest value of a bucket
+ */
+static long long bucket_top(int bucket) {
+    if (bucket < HISTOGRAM_SUB) {
+        return bucket;
+    }
+    int k = (bucket - HISTOGRAM_SUB) / (HISTOGRAM_SUB / 2) + HISTOGRAM_BITS;
+    int shift = k - HISTOGRAM_BITS + 1;
+    long long sub = (bucket - HISTOGRAM_SUB) % (HISTOGRAM_SUB / 2) + HISTOGRAM_SUB / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+/* Makes room for buckets up to the given one
+ */
+static void histogram_grow(histogram_t *hist, int bucket) {
+    if (bucket < hist->size) {
+        return;
+    }
+    int size = hist->size ? hist->size : HISTOGRAM_SUB;
+    while (size <= bucket) {
+        size *= 2;
+    }
+    hist->counts = realloc(hist->counts, size * sizeof(long long));
+    assert(hist->counts);
+    memset(hist->counts + hist->size, 0, (size - hist->size) * sizeof(long long));
+    hist->size = size;
+}
+
+extern void histogram_record(histogram_t *hist, long long value) {
+    if (value < 0) {
+        value = 0;
+    }
+    int bucket = bucket_of(value);
+    if (bucket >= hist->size) {
+        histogram_grow(hist, bucket);
+    }
+    hist->counts[bucket]++;
+    if (hist->count == 0 || value < hist->min) {
+        hist->min = value;
+    }
+    if (hist->count == 0 || value > hist->max) {
+        hist->max = value;
+    }
+    hist->count++;
+    hist->sum += value;
+}
+
+extern void histogram_merge(histogram_t *into, const histogram_t *from) {
+    if (from->count == 0) {
+        return;
+    }
+    histogram_grow(into, from->size - 1);
+    for (int i = 0; i < from->size; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    if (into->count == 0 || from->min < into->min) {
+        into->min = from->min;
+    }
+    if (into->count == 0 || from->max > into->max) {
+        into->max = from->max;
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+}
+
+extern long long histogram_percentile(const histogram_t *hist, double percentile) {
+    if (hist->count == 0) {
+        return 0;
+    }
+
+    /* The value at a percentile is the one at that rank, rounded up, among the values in increasing order
+     */
+    double exact = percentile / 100.0 * hist->count;
+    long long rank = (long long)exact;
+    if (rank < exact) {
+        rank++;
+    }
+    if (rank < 1) {
+        rank = 1;
+    }
+    long long seen = 0;
+    for (int i = 0; i < hist->size; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            long long top = bucket_top(i);
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+extern double histogram_mean(const histogram_t *hist) {
+    return hist->count > 0 ? (double)hist->sum / hist->count : 0.0;
+}
+
+extern void histogram_save(checkpoint_t *ck, const histogram_t *hist) {
+    saved_histogram record = {hist->count, hist->sum, hist->min, hist->max, hist->size};
+    checkpoint_put(ck, &record, sizeof(record));
+    checkpoint_put(ck, hist->counts, hist->size * sizeof(long long));
+}
+
+extern int histogram_restore(checkpoint_t *ck, histogram_t *hist) {
+    const saved_histogram *record = checkpoint_get(ck, sizeof(saved_histogram));
+    const long long *counts = record && record->size >= 0 ?
+                              checkpoint_get(ck, record->size * sizeof(long long)) : NULL;
+    if (!counts) {
+        return 0;
+    }
+    if (record->size > 0) {
+        histogram_grow(hist, record->size - 1);
+        memcpy(hist->counts, counts, record->size * sizeof(long long));
+    }
+    hist->count = record->count;
+    hist->sum = record->sum;
+    hist->min = record->min;
+    hist->max = record->max;
+    return 1;
+}
@@ -0,0 +1,79 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/* This is a streaming histogram of non-negative tick counts with log-linear buckets, in the style of
+ * HdrHistogram. Values below HISTOGRAM_SUB are counted exactly; above that every power of two is split
+ * into HISTOGRAM_SUB / 2 buckets, so a bucket is never wider than 2 / HISTOGRAM_SUB of the values in it.
+ * Recording a value is a shift and an increment. The bucket array only grows as far as the largest value
+ * recorded, so a histogram of short waits stays a few hundred bytes however many values it counts.
+ */
+
+#define HISTOGRAM_BITS 6
+#define HISTOGRAM_SUB (1 << HISTOGRAM_BITS)
+
+struct checkpoint;
+
+typedef struct histogram {
+    long long *counts;          /* count of values in each bucket */
+    int size;                   /* number of buckets allocated */
+    long long count;            /* number of values recorded */
+    long long sum;              /* sum of the values recorded */
+    long long min;              /* smallest value recorded, if any */
+    long long max;              /* largest value recorded, if any */
+} histogram_t;
+
+/* Records a value
+ * @params:
+ *   hist : pointer to the histogram
+ *   value: value to record, negative values are recorded as 0
+ * @returns:
+ *   none
+ */
+extern void histogram_record(histogram_t *hist, long long value);
+
+/* Adds every value recorded in one histogram to another
+ * @params:
+ *   into: histogram to add to
+ *   from: histogram to add
+ * @returns:
+ *   none
+ */
+extern void histogram_merge(histogram_t *into, const histogram_t *from);
+
+/* Returns the value at a percentile of the values recorded
+ * The value is the largest one its bucket can hold, but never more than the largest value recorded.
+ * @params:
+ *   hist      : pointer to the histogram
+ *   percentile: between 0 and 100
+ * @returns:
+ *   the value, or 0 if nothing was recorded
+ */
+extern long long histogram_percentile(const histogram_t *hist, double percentile);
+
+/* Returns the mean of the values recorded
+ * @params:
+ *   hist: pointer to the histogram
+ * @returns:
+ *   the mean, or 0 if nothing was recorded
+ */
+extern double histogram_mean(const histogram_t *hist);
+
+/* Saves a histogram in a checkpoint
+ * @params:
+ *   ck  : checkpoint being written
+ *   hist: pointer to the histogram
+ * @returns:
+ *   none
+ */
+extern void histogram_save(struct checkpoint *ck, const histogram_t *hist);
+
+/* Restores a histogram saved by histogram_save into an empty one
+ * @params:
+ *   ck  : checkpoint being read
+ *   hist: pointer to the histogram
+ * @returns:
+ *   1 on success, 0 if the checkpoint is damaged
+ */
+extern int histogram_restore(struct checkpoint *ck, histogram_t *hist);
+
+#endif
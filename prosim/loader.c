@@ -0,0 +1,304 @@
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "loader.h"
+
+#define READ_BLOCK (4 << 20)
+#define PARALLEL_PROGRAMS 1024  /* fewest programs worth handing to a thread of their own */
+#define MAX_LOADERS 64
+
+/* Programs parsed by one thread: first to last - 1, from the starts found by the first pass
+ */
+typedef struct {
+    real_priority **procs;
+    const char **starts;        /* start of every program found, then where the first pass stopped */
+    int num_procs;
+    const char *end;
+    int fuse;
+    int first;
+    int last;
+    int failed;                 /* first program that failed or did not end at the next start, or last */
+    int misplaced;              /* 1 if that program parsed but did not end at the next start */
+    const char *resume;         /* where that program ended, if misplaced */
+    char error[CONTEXT_ERROR_SIZE];
+} load_task;
+
+static int is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static void skip_space(scanner_t *in) {
+    while (in->pos < in->end && is_space(*in->pos)) {
+        in->pos++;
+    }
+}
+
+extern int scan_word(scanner_t *in, char *word, int max) {
+    skip_space(in);
+    int n = 0;
+    while (n < max && in->pos < in->end && !is_space(*in->pos)) {
+        word[n++] = *in->pos++;
+    }
+    word[n] = '\0';
+    return n > 0;
+}
+
+extern int scan_long(scanner_t *in, long long *value) {
+    skip_space(in);
+    const char *p = in->pos;
+    int negative = 0;
+    if (p < in->end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (p == in->end || *p < '0' || *p > '9') {
+        return 0;
+    }
+
+    /* Out of range numbers are clamped as strtoll clamps them
+     */
+    unsigned long long limit = negative ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+    unsigned long long n = 0;
+    for (; p < in->end && *p >= '0' && *p <= '9'; p++) {
+        unsigned digit = *p - '0';
+        n = n > (limit - digit) / 10 ? limit : n * 10 + digit;
+    }
+    in->pos = p;
+    *value = negative ? (long long)(0 - n) : (long long)n;
+    return 1;
+}
+
+extern int scan_int(scanner_t *in, int *value) {
+    long long n;
+    if (!scan_long(in, &n)) {
+        return 0;
+    }
+    *value = (int)n;
+    return 1;
+}
+
+/***
+*Maps the input if it is a regular file, otherwise reads it in blocks until its end
+*/
+extern int loader_open(loader_t *input, int fd) {
+    memset(input, 0, sizeof(*input));
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            input->map = map;
+            input->map_size = st.st_size;
+
+            /* Only what is left of the input from the current offset is to be read
+             */
+            off_t offset = lseek(fd, 0, SEEK_CUR);
+            if (offset < 0 || offset > st.st_size) {
+                offset = 0;
+            }
+            input->data = map + offset;
+            input->size = st.st_size - offset;
+            return 1;
+        }
+    }
+
+    size_t capacity = 0;
+    for (;;) {
+        if (input->size + READ_BLOCK > capacity) {
+            capacity = capacity ? 2 * capacity : 2 * READ_BLOCK;
+            input->data = realloc(input->data, capacity);
+            assert(input->data);
+        }
+        ssize_t n = read(fd, input->data + input->size, capacity - input->size);
+        if (n < 0) {
+            free(input->data);
+            input->data = NULL;
+            return 0;
+        }
+        if (n == 0) {
+            return 1;
+        }
+        input->size += n;
+    }
+}
+
+extern void loader_close(loader_t *input) {
+    if (input->map) {
+        munmap(input->map, input->map_size);
+    } else {
+        free(input->data);
+    }
+    memset(input, 0, sizeof(*input));
+}
+
+/***
+*Parses and compiles one program description, numbering it as the given process
+*Returns the process, or NULL with the message in error
+*/
+static real_priority *load_program(scanner_t *in, int index, int fuse, char *error) {
+    real_priority *proc = context_parse(in, error);
+    if (!proc || !context_compile(proc, fuse, error)) {
+        return NULL;
+    }
+    proc->index = index;
+    return proc;
+}
+
+/***
+*Releases a process parsed from the wrong place of the input
+*/
+static void discard_program(real_priority *proc) {
+    free(proc->code);
+    free(proc->stack_base);
+    free(proc);
+}
+
+/***
+*Returns the start of the line after the one the scanner is on
+*/
+static const char *next_line(const scanner_t *in) {
+    const char *eol = memchr(in->pos, '\n', in->end - in->pos);
+    return eol ? eol + 1 : in->end;
+}
+/***
+*Finds where each program starts by reading its header and skipping a line per primitive
+*Stops at the first program whose header does not read. Returns the number of programs found.
+*/
+static int find_programs(scanner_t in, const char **starts, int num_procs) {
+    int found;
+    for (found = 0; found < num_procs; found++) {
+        skip_space(&in);
+        starts[found] = in.pos;
+
+        char name[11];
+        int size, priority, thread;
+        if (!scan_word(&in, name, 10) || !scan_int(&in, &size) || !scan_int(&in, &priority) ||
+            !scan_int(&in, &thread) || size < 0) {
+            return found;
+        }
+
+        /* The rest of the header line, then a line per primitive, blank lines aside
+         */
+        in.pos = next_line(&in);
+        for (int i = 0; i < size && in.pos < in.end; i++) {
+            skip_space(&in);
+            in.pos = next_line(&in);
+        }
+    }
+    skip_space(&in);
+    starts[found] = in.pos;
+    return found;
+}
+/***
+*Parses the programs of a task, stopping at the first that fails or does not end where the next
+*one was found to start
+*/
+static void *load_task_run(void *arg) {
+    load_task *task = arg;
+    for (int i = task->first; i < task->last; i++) {
+        scanner_t in = {task->starts[i], task->end};
+        task->procs[i] = load_program(&in, i, task->fuse, task->error);
+        if (!task->procs[i]) {
+            task->failed = i;
+            return NULL;
+        }
+
+        /* The last program of the input may be followed by anything, as nothing reads past it.
+         */
+        if (i + 1 < task->num_procs) {
+            skip_space(&in);
+            if (in.pos != task->starts[i + 1]) {
+                task->failed = i;
+                task->misplaced = 1;
+                task->resume = in.pos;
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+/***
+*Parses the programs found by the first pass on several threads, then the rest in order
+*/
+extern int loader_programs(scanner_t *in, real_priority **procs, int num_procs, int fuse) {
+    char error[CONTEXT_ERROR_SIZE];
+    int next = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = num_procs / PARALLEL_PROGRAMS;
+    if (threads > cpus) {
+        threads = cpus;
+    }
+    if (threads > MAX_LOADERS) {
+        threads = MAX_LOADERS;
+    }
+
+    if (threads > 1) {
+        const char **starts = malloc((num_procs + 1) * sizeof(const char *));
+        assert(starts);
+        int found = find_programs(*in, starts, num_procs);
+
+        load_task tasks[MAX_LOADERS];
+        pthread_t ids[MAX_LOADERS];
+        for (int t = 0; t < threads; t++) {
+            load_task *task = &tasks[t];
+            memset(task, 0, sizeof(*task));
+            task->procs = procs;
+            task->starts = starts;
+            task->num_procs = num_procs;
+            task->end = in->end;
+            task->fuse = fuse;
+            task->first = (long long)found * t / threads;
+            task->last = (long long)found * (t + 1) / threads;
+            task->failed = task->last;
+            int result = pthread_create(&ids[t], NULL, load_task_run, task);
+            assert(result == 0);
+        }
+        for (int t = 0; t < threads; t++) {
+            int result = pthread_join(ids[t], NULL);
+            assert(result == 0);
+        }
+
+        /* Everything before the first task that stopped early is loaded. The programs parsed after
+         * it may have been read from the wrong place, so they are dropped and read again in order.
+         */
+        next = found;
+        in->pos = starts[found];
+        for (int t = 0; t < threads; t++) {
+            load_task *task = &tasks[t];
+            if (task->failed == task->last) {
+                continue;
+            }
+            if (!task->misplaced) {
+                fprintf(stderr, "%s", task->error);
+                free(starts);
+                return 0;
+            }
+            next = task->failed + 1;
+            in->pos = task->resume;
+            for (int i = next; i < found; i++) {
+                if (procs[i]) {
+                    discard_program(procs[i]);
+                    procs[i] = NULL;
+                }
+            }
+            break;
+        }
+        free(starts);
+    }
+
+    for (int i = next; i < num_procs; i++) {
+        procs[i] = load_program(in, i, fuse, error);
+        if (!procs[i]) {
+            fprintf(stderr, "%s", error);
+            return 0;
+        }
+    }
+    return 1;
+}
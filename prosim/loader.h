@@ -0,0 +1,87 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stddef.h>
+#include "context.h"
+
+/* Loader of the input.
+ * The whole input is taken in at once: mapped into memory if it is a regular file, otherwise read in
+ * large blocks. It is then read with a scanner that takes words and numbers as scanf's %s, %d and %lld
+ * take them, so the input is accepted or rejected as before, with the same messages.
+ * Program descriptions do not depend on each other, so a large input is parsed in parallel: a first pass
+ * finds where each program starts, assuming one primitive per line, and the programs are then parsed on
+ * several threads. Each program is checked to end where the next one was found to start; from the first
+ * that does not, the rest of the input is parsed in order, so unusual layouts still load as before.
+ */
+
+typedef struct scanner {
+    const char *pos;            /* next character to read */
+    const char *end;            /* end of the input */
+} scanner_t;
+
+typedef struct loader {
+    char *data;                 /* the whole input */
+    size_t size;
+    char *map;                  /* mapping of the input file that data is in, NULL if the input was read */
+    size_t map_size;
+} loader_t;
+
+/* Reads a word as scanf's %Ns does: skips white space, then takes up to max characters up to the
+ * next white space
+ * @params:
+ *   in  : scanner
+ *   word: buffer of at least max + 1 characters, receives the word
+ *   max : most characters to take
+ * @returns:
+ *   1 on success, 0 at the end of the input
+ */
+extern int scan_word(scanner_t *in, char *word, int max);
+
+/* Reads a number as scanf's %lld does: skips white space, then takes an optional sign and digits
+ * @params:
+ *   in   : scanner
+ *   value: receives the number
+ * @returns:
+ *   1 on success, 0 if there is no number
+ */
+extern int scan_long(scanner_t *in, long long *value);
+
+/* Reads a number as scanf's %d does
+ * @params:
+ *   in   : scanner
+ *   value: receives the number
+ * @returns:
+ *   1 on success, 0 if there is no number
+ */
+extern int scan_int(scanner_t *in, int *value);
+
+/* Takes in the whole input of a file descriptor
+ * @params:
+ *   input: loader to fill in
+ *   fd   : file descriptor of the input
+ * @returns:
+ *   1 on success, 0 if the input could not be read
+ */
+extern int loader_open(loader_t *input, int fd);
+
+/* Releases the input once it has been parsed
+ * @params:
+ *   input: loader filled in by loader_open
+ * @returns:
+ *   none
+ */
+extern void loader_close(loader_t *input);
+
+/* Parses and compiles the program descriptions, numbering the processes in input order.
+ * On error, the message of the first program in input order that failed is printed.
+ * @params:
+ *   in       : scanner, at the first program description
+ *   procs    : receives the processes
+ *   num_procs: number of program descriptions
+ *   fuse     : passed on to context_compile
+ * @returns:
+ *   1 on success, 0 if a program description is bad
+ */
+extern int loader_programs(scanner_t *in, real_priority **procs, int num_procs, int fuse);
+
+#endif
@@ -0,0 +1,87 @@
+#!/bin/bash
+
+# Checks that lookahead only changes how the nodes are stepped, not what they do.
+# Each configuration is run with --sequential in lockstep and with --lookahead; the trace, the
+# summary with the utilization of every core, and the report must come out the same. Node 01
+# has nothing to run after tick 0 and node 03 runs out of work while node 02 still has messages
+# to exchange, so both must end on their own tick and not on the horizon of the others.
+#
+# USAGE:
+#   ./lookahead_test.sh [prosim]
+
+EXE=${1:-./prosim}
+if [ ! -x $EXE ]; then
+	echo Cannot find $EXE
+	exit 1
+fi
+RUN="timeout 10 $EXE"
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+cat > $DIR/input.txt <<EOF
+5 2 3
+idle 1 1 1
+HALT
+ping 6 1 2
+DOOP 30
+LOOP 3
+SEND 202
+RECV 202
+END
+HALT
+pong 7 2 2
+DOOP 12
+LOOP 3
+RECV 201
+DOOP 25
+SEND 201
+END
+HALT
+short 3 1 3
+DOOP 4
+DOOP 6
+HALT
+sleepy 3 2 3
+BLOCK 9
+DOOP 2
+HALT
+EOF
+
+CONFIGS=(
+	""
+	"--cores 2"
+	"--sched rr --cores 2"
+	"--sched cfs --cores 2 --runqueue percore"
+	"--fuse"
+)
+
+failed=0
+for config in "${CONFIGS[@]}"; do
+	$RUN --sequential $config --report $DIR/lockstep.json < $DIR/input.txt > $DIR/lockstep.txt 2>&1 &&
+	$RUN --sequential $config --lookahead --report $DIR/lookahead.json < $DIR/input.txt > $DIR/lookahead.txt 2>&1
+	if [ $? -ne 0 ]; then
+		echo "FAIL ${config:-default}: the run failed"
+		failed=1
+		continue
+	fi
+	if ! cmp -s $DIR/lockstep.txt $DIR/lookahead.txt; then
+		echo "FAIL ${config:-default}: the output differs"
+		diff $DIR/lockstep.txt $DIR/lookahead.txt | grep '| Node'
+		failed=1
+		continue
+	fi
+	if ! cmp -s $DIR/lockstep.json $DIR/lookahead.json; then
+		echo "FAIL ${config:-default}: the report differs"
+		diff $DIR/lockstep.json $DIR/lookahead.json
+		failed=1
+		continue
+	fi
+	echo "ok ${config:-default}"
+done
+
+if [ $failed -ne 0 ]; then
+	echo Lookahead FAILED
+	exit 1
+fi
+echo Lookahead passed
@@ -1,105 +1,252 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
 #include "context.h"
+#include "loader.h"
 #include "process.h"
 #include "message.h"
-#include "barrier.h"
+#include "engine.h"
+#include "balance.h"
+#include "trace.h"
 
 static real_priority **procs;
 
-typedef struct thread_args {
-    int id;         /* Node id of thread */
-} thread_args;
-
-/* Node runner
- * @params:
- *   arg : node id of thread
- * @returns:
- *   NULL
- */
-static void *thread_runner(void *arg) {
-    thread_args *thd_arg = (thread_args *)arg;
-
-    processor_t *cpu = process_new();
-    cpu->node_id = thd_arg->id;
-    for (int i = 0; procs[i]; i++) {
-        if (procs[i]->thread == thd_arg->id) {
-            process_admit(cpu, procs[i]);
-        }
-    }
-
-    // Waiting  for all threads to finish initialization
-    barrier_wait();
-
-    process_simulate(cpu);
-
-    return NULL;
-}
-
 /* Main line
  * @params:
- *   None
+ *   argc, argv : command line options
+ *     --lookahead lets nodes run ahead between messages
+ *     --stride N sets the address of a process to node * N + id (default 100)
+ *     --mailbox N sets how many ASEND messages a channel buffers (default 16)
+ *     --network FILE loads link latencies and bandwidths between the nodes
+ *     --workers N runs the nodes on N threads (default one per processor, at most one per node)
+ *     --sequential runs the nodes on the main thread in node order, for a deterministic trace
+ *     --sched NAME picks the scheduling policy of the nodes (default prio)
+ *     --cores N gives every node N cores (default 1)
+ *     --runqueue shared|percore picks one ready queue per node or one per core (default shared)
+ *     --balance push|pull moves ready processes between nodes (default off)
+ *     --balance-period N runs the push balancer every N ticks (default 100)
+ *     --migration-cost N keeps a moved process from running for N ticks (default 1)
+ *     --checkpoint FILE writes the state of the simulation to FILE once every node is past --checkpoint-at
+ *     --checkpoint-at N sets the tick of the checkpoint (default 0)
+ *     --restore FILE resumes the simulation saved in FILE instead of reading one from the input,
+ *       with the settings it was saved with
+ *     --trace FILE writes the trace to FILE as binary records for prosim-trace instead of as text
+ *     --report FILE writes latency percentiles and the utilization of every node to FILE
+ *     --report-format json|csv picks the format of the report (default json)
+ *     --fuse fuses adjacent DOOPs and loops of a single DOOP, so each runs as one primitive
  * @returns:
  *   0
  */
-int main() {
+int main(int argc, char **argv) {
+    int lookahead = 0;
+    long long stride = 100;
+    int mailbox = 16;
+    const char *network = NULL;
+    int workers = 0;
+    int sequential = 0;
+    const sched_policy_t *policy = sched_find("prio");
+    int cores = 1;
+    int per_core = 0;
+    const balancer_t *balancer = NULL;
+    int balance_period = 100;
+    int migration_cost = 1;
+    const char *checkpoint = NULL;
+    long long checkpoint_at = 0;
+    const char *restore = NULL;
+    const char *trace = NULL;
+    const char *report = NULL;
+    int report_csv = 0;
+    int fuse = 0;
     int num_procs;
     int quantum;
     int num_threads;
-    thread_args *args;
 
-    /* Read in the header of the process description with minimal validation
-     */
-    if (scanf("%d %d %d", &num_procs, &quantum, &num_threads) < 3) {
-        fprintf(stderr, "Bad input, expecting # of processes, quantum, and # of threads\n");
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--lookahead")) {
+            lookahead = 1;
+        } else if (!strcmp(argv[i], "--stride") && i + 1 < argc && atoll(argv[i + 1]) > 0) {
+            stride = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "--mailbox") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            mailbox = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--network") && i + 1 < argc) {
+            network = argv[++i];
+        } else if (!strcmp(argv[i], "--sched") && i + 1 < argc && sched_find(argv[i + 1])) {
+            policy = sched_find(argv[++i]);
+        } else if (!strcmp(argv[i], "--cores") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            cores = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--runqueue") && i + 1 < argc &&
+                   (!strcmp(argv[i + 1], "shared") || !strcmp(argv[i + 1], "percore"))) {
+            per_core = !strcmp(argv[++i], "percore");
+        } else if (!strcmp(argv[i], "--balance") && i + 1 < argc && balance_find(argv[i + 1])) {
+            balancer = balance_find(argv[++i]);
+        } else if (!strcmp(argv[i], "--balance-period") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            balance_period = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--migration-cost") && i + 1 < argc && atoi(argv[i + 1]) >= 0 &&
+                   argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+            migration_cost = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+            checkpoint = argv[++i];
+        } else if (!strcmp(argv[i], "--checkpoint-at") && i + 1 < argc && atoll(argv[i + 1]) >= 0 &&
+                   argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+            checkpoint_at = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "--restore") && i + 1 < argc) {
+            restore = argv[++i];
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (!strcmp(argv[i], "--report") && i + 1 < argc) {
+            report = argv[++i];
+        } else if (!strcmp(argv[i], "--report-format") && i + 1 < argc &&
+                   (!strcmp(argv[i + 1], "json") || !strcmp(argv[i + 1], "csv"))) {
+            report_csv = !strcmp(argv[++i], "csv");
+        } else if (!strcmp(argv[i], "--fuse")) {
+            fuse = 1;
+        } else if (!strcmp(argv[i], "--sequential")) {
+            sequential = 1;
+        } else if (!strcmp(argv[i], "--workers") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            workers = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--lookahead] [--stride N] [--mailbox N] [--network FILE] "
+                    "[--workers N | --sequential] [--sched %s] [--cores N] [--runqueue shared|percore] "
+                    "[--balance %s] [--balance-period N] [--migration-cost N] "
+                    "[--checkpoint FILE] [--checkpoint-at N] [--trace FILE] [--report FILE] "
+                    "[--report-format json|csv] [--fuse] [--restore FILE | < input]\n",
+                    argv[0], sched_names(), balance_names());
+            return -1;
+        }
+    }
+
+    if (trace && !trace_open(trace)) {
+        fprintf(stderr, "Bad trace, could not create %s\n", trace);
+        return -1;
+    }
+    FILE *freport = NULL;
+    if (report && !(freport = fopen(report, "w"))) {
+        fprintf(stderr, "Bad report, could not create %s\n", report);
         return -1;
     }
 
-    /* We use an array of pointers to contexts to track the processes.
-     * We also use an array of args for the nodes and an array for thread IDs
+    /* A restored simulation comes with its processes, nodes and settings.
      */
-    procs  = calloc(num_procs + 1, sizeof(real_priority *));
-    args  = calloc(num_procs + 1, sizeof(thread_args));
-    pthread_t *tid = calloc(num_threads, sizeof(pthread_t));
+    processor_t **cpus;
+    if (restore) {
+        if (!engine_restore(restore, &procs, &num_procs, &cpus, &num_threads, &balancer)) {
+            return -1;
+        }
+        cores = cpus[0]->num_cores;
+    } else {
+        /* Take in the whole input, then read in the header of the process description
+         * with minimal validation
+         */
+        loader_t input;
+        if (!loader_open(&input, STDIN_FILENO)) {
+            fprintf(stderr, "Bad input, could not read the input\n");
+            return -1;
+        }
+        scanner_t in = {input.data, input.data + input.size};
+        if (!scan_int(&in, &num_procs) || !scan_int(&in, &quantum) || !scan_int(&in, &num_threads)) {
+            fprintf(stderr, "Bad input, expecting # of processes, quantum, and # of threads\n");
+            return -1;
+        }
+        if (num_procs < 0 || num_threads < 0) {
+            fprintf(stderr, "Bad input, # of processes and # of threads cannot be negative\n");
+            return -1;
+        }
 
-    process_init(quantum);
-    create_message();
-    create_barrier(num_threads);
+        /* We use an array of pointers to contexts to track the processes
+         * and an array of node contexts.
+         */
+        procs  = calloc(num_procs + 1, sizeof(real_priority *));
+        cpus = calloc(num_threads + 1, sizeof(processor_t *));
+        assert(procs != NULL && cpus != NULL);
+
+        process_init(quantum, lookahead, policy, cores, per_core);
+        create_message(num_threads, stride, mailbox);
+        balance_init(balance_period, migration_cost);
+        if (network) {
+            FILE *fnet = fopen(network, "r");
+            if (!fnet) {
+                fprintf(stderr, "Bad network, could not open %s\n", network);
+                return -1;
+            }
+            int loaded = message_load_network(fnet);
+            fclose(fnet);
+            if (!loaded) {
+                return -1;
+            }
+        }
 
-    /* Load process, if  error occurs, abort.
-     */
-    for (int i = 0; i < num_procs; i++) {
-        procs[i] = context_load(stdin);
-        if (!procs[i]) {
+        /* Load process, if  error occurs, abort.
+         */
+        if (!loader_programs(&in, procs, num_procs, fuse)) {
             fprintf(stderr, "Bad input, could not load program description\n");
             return -1;
         }
-    }
+        loader_close(&input);
+
+        /* Process ids on a node run from 1, so they must stay below the stride for
+         * every process to have its own address.
+         */
+        int *node_procs = calloc(num_threads + 1, sizeof(int));
+        assert(node_procs != NULL);
+        for (int i = 0; i < num_procs; i++) {
+            int node = procs[i]->thread;
+            if (node >= 1 && node <= num_threads && ++node_procs[node] >= stride) {
+                fprintf(stderr, "Bad input, node %d has %lld or more processes, use a larger --stride\n",
+                        node, stride);
+                return -1;
+            }
+        }
+        free(node_procs);
 
 
-    /* Create threads and assume creation will be successful (or just die)
-     */
-    for (int i = 0; i < num_threads; i++) {
-        /* This is where we assign node ids
+        /* Create the nodes, this is where we assign node ids.
+         * Each node admits its processes in input order.
          */
-        args[i].id = i + 1;
-        int result = pthread_create(&tid[i], NULL, thread_runner, &args[i]);
-        assert(result == 0);
+        for (int i = 0; i < num_threads; i++) {
+            cpus[i] = process_new();
+            cpus[i]->node_id = i + 1;
+        }
+        for (int i = 0; procs[i]; i++) {
+            int node = procs[i]->thread;
+            if (node >= 1 && node <= num_threads) {
+                process_admit(cpus[node - 1], procs[i]);
+            }
+        }
+    }
+    if (checkpoint) {
+        engine_checkpoint(checkpoint, checkpoint_at, procs, num_procs);
     }
 
-    /* Wait for threads to complete and assume we will be successful (or just die)
+    /* Run the nodes until they are all done. Without nodes, there is nothing to run.
      */
-    for (int i = 0; i < num_threads; i++) {
-        int result = pthread_join(tid[i], NULL);
-        assert(result == 0);
+    if (sequential) {
+        engine_run_sequential(cpus, num_threads, balancer);
+    } else if (num_threads > 0) {
+        if (workers == 0 || workers > num_threads) {
+            workers = engine_default_workers(num_threads);
+        }
+        engine_run(cpus, num_threads, workers, balancer);
     }
+    trace_close();
 
 
     /* Output the statistics for processes.
      */
-    process_summary(stdout);
+    process_summary(cpus, num_threads, stdout);
+    if (cores > 1) {
+        for (int i = 0; i < num_threads; i++) {
+            process_utilization(cpus[i], stdout);
+        }
+    }
+    if (freport) {
+        process_report(cpus, num_threads, freport, report_csv);
+        fclose(freport);
+    }
+    if (checkpoint && !engine_checkpoint_done()) {
+        return -1;
+    }
 
     return 0;
 }
\ No newline at end of file
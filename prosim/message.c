@@ -4,142 +4,997 @@
 
 #include "message.h"
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
+#include "checkpoint.h"
 
 #define MAX_PROCS 100
-#define MAX_CONTEXTS 10000
+#define CACHE_LINE 64
+#define SHARD_BITS 6
+#define SHARDS (1 << SHARD_BITS)
+#define INITIAL_SLOTS 16
 
-//Table for sender/reciever pair to synchronize message
+//Channel from one sender address to one receiver address.
+//Holds the sender/reciever waiting to synchronize message, and the mailbox of messages sent
+//with ASEND that the receiver has not taken yet.
 typedef struct {
-    pthread_mutex_t lock;
-    real_priority *sender_waiting;
-    real_priority *receiver_waiting;
-    int sender_addr;
-    int receiver_addr;
+    long long sender_addr;
+    long long receiver_addr;
+    real_priority *sender_waiting;      /* blocked in SEND, or in ASEND on a full mailbox */
+    real_priority *receiver_waiting;    /* blocked in RECV on an empty mailbox */
+    long long *mailbox;                 /* ring of arrival ticks, NULL while the mailbox is empty */
+    int head;                           /* index of the oldest message in the ring */
+    int count;                          /* number of messages in the ring */
 } process_comm_table;
 
-static process_comm_table coms_table[MAX_CONTEXTS];
+//Open-addressing hash table of the active channels, split into shards that are locked independently.
+//A channel is removed as soon as nobody waits on it and its mailbox is empty, so memory follows
+//the number of active channels and not the size of the address space.
+//Empty rings are kept on a free list per shard, so sending a message does not allocate.
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    process_comm_table *slots;  /* linear probing, see slot_used for what marks a free slot */
+    int capacity;               /* number of slots, a power of two */
+    int used;                   /* number of channels in the shard */
+    long long **free_rings;     /* rings not in use by any channel */
+    int num_free_rings;
+    int max_free_rings;
+} comm_shard;
+
+static comm_shard coms_table[SHARDS];
+static long long address_stride = 100;
+static int mailbox_size = 16;
+
+//Inbox of processes released by the message system, one per node.
+//Any node pushes onto the list lock-free; only the owning node takes the whole list at once,
+//moving it to a queue ordered by the tick at which each message reaches the node.
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic(real_priority *) head;
+    prio_q_t *arrivals;         /* drained processes whose message has not arrived yet */
+    real_priority **ready;      /* the owning node's arrived processes, sorted by id */
+    int capacity;
+    real_priority **residents;  /* processes addressed on this node, by id - 1, wherever they run */
+    int num_residents;
+} message_inbox;
+
+static message_inbox *inboxes;
+static int inbox_count = 0;
+
+//Network between the nodes. Without one every message arrives on the tick it is sent.
+//Links are indexed by [sender node - 1][receiver node - 1].
+typedef struct {
+    int nodes;
+    int *latency;                   /* ticks a message spends on the link */
+    int *bandwidth;                 /* messages the link accepts per tick, 0 for no limit */
+    _Atomic long long *next_slot;   /* first free sending slot on the link, in 1/bandwidth ticks */
+} network_model;
+
+static network_model *network = NULL;
+
+//Earliest arrival of the messages this thread has sent since it last asked for its next arrival
+static _Thread_local long long sent_arrival = LLONG_MAX;
+
+//Process group taking part in a collective primitive.
+//The members are the processes whose code has the same collective primitive with the same argument:
+//the address of the root for BCAST and GATHER, a group number for BARRIER.
+//A round completes when every member has arrived; until then the members wait on a single counter.
+typedef struct {
+    int op;
+    long long arg;
+    int size;                       /* number of members */
+    real_priority *last_member;     /* last process registered, so a process counts once */
+    pthread_mutex_t lock;
+    int arrived;                    /* members waiting in the current round */
+    real_priority **members;        /* members of the current round in the order they arrived */
+    long long *ticks;               /* release tick of each member, used when a round completes */
+} collective_group;
+
+//Open-addressing hash table of the groups. It is filled while processes are admitted and
+//only read once the simulation runs, so lookups do not lock it.
+static collective_group **groups = NULL;
+static int group_capacity = 0;
+static int group_count = 0;
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
 
-//List for ready processes
-static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
-static real_priority *ready_list[2 * MAX_PROCS];
-static int ready_count = 0;
+//Number of processes parked in coms_table and number of released processes not yet picked up.
+//Kept next to the tables so that the termination check does not have to scan them.
+static _Atomic int waiting_count = 0;
+static _Atomic int in_flight_count = 0;
 
 /***
 *Create and initialize all tables
 */
-void create_message() {
-    for (int i = 0; i < MAX_CONTEXTS; i++) {
+void create_message(int num_nodes, long long stride, int mailbox) {
+    assert(stride > 0);
+    assert(mailbox > 0);
+    address_stride = stride;
+    mailbox_size = mailbox;
+    for (int i = 0; i < SHARDS; i++) {
         pthread_mutex_init(&(coms_table[i].lock), NULL);
-        coms_table[i].receiver_waiting = NULL;
-        coms_table[i].sender_waiting = NULL;
-        coms_table[i].sender_addr = 0;
-        coms_table[i].receiver_addr = 0;
+        free(coms_table[i].slots);
+        coms_table[i].slots = NULL;
+        coms_table[i].capacity = 0;
+        coms_table[i].used = 0;
+        while (coms_table[i].num_free_rings > 0) {
+            free(coms_table[i].free_rings[--coms_table[i].num_free_rings]);
+        }
+    }
+
+    if (inboxes) {
+        for (int i = 0; i <= inbox_count; i++) {
+            free(inboxes[i].residents);
+        }
+    }
+    free(inboxes);
+    inbox_count = num_nodes;
+    inboxes = aligned_alloc(CACHE_LINE, (num_nodes + 1) * sizeof(message_inbox));
+    assert(inboxes != NULL);
+    for (int i = 0; i <= num_nodes; i++) {
+        atomic_init(&inboxes[i].head, NULL);
+        inboxes[i].arrivals = prio_q_new();
+        inboxes[i].ready = NULL;
+        inboxes[i].capacity = 0;
+        inboxes[i].residents = NULL;
+        inboxes[i].num_residents = 0;
+    }
+
+    for (int i = 0; i < group_capacity; i++) {
+        if (groups[i]) {
+            free(groups[i]->members);
+            free(groups[i]->ticks);
+            free(groups[i]);
+        }
+    }
+    free(groups);
+    groups = NULL;
+    group_capacity = 0;
+    group_count = 0;
+
+    network = NULL;
+    atomic_store(&waiting_count, 0);
+    atomic_store(&in_flight_count, 0);
+}
+/***
+*Loads the network model: the number of nodes N, an N x N matrix of link latencies in ticks and
+*an N x N matrix of link bandwidths in messages per tick (0 for no limit), row i being the links
+*from node i + 1. Must be called after create_message.
+*Returns 1 on success, or prints an error and returns 0
+*/
+int message_load_network(FILE *fin) {
+    network_model *net = calloc(1, sizeof(network_model));
+    assert(net);
+
+    if (fscanf(fin, "%d", &net->nodes) < 1 || net->nodes < inbox_count) {
+        fprintf(stderr, "Bad network: Expecting the number of nodes, at least %d\n", inbox_count);
+        return 0;
+    }
+
+    int links = net->nodes * net->nodes;
+    net->latency = malloc(links * sizeof(int));
+    net->bandwidth = malloc(links * sizeof(int));
+    net->next_slot = calloc(links, sizeof(*net->next_slot));
+    assert(net->latency && net->bandwidth && net->next_slot);
+
+    for (int i = 0; i < links; i++) {
+        if (fscanf(fin, "%d", &net->latency[i]) < 1 || net->latency[i] < 0) {
+            fprintf(stderr, "Bad network: Expecting latency from node %d to node %d\n",
+                    i / net->nodes + 1, i % net->nodes + 1);
+            return 0;
+        }
+    }
+    for (int i = 0; i < links; i++) {
+        if (fscanf(fin, "%d", &net->bandwidth[i]) < 1 || net->bandwidth[i] < 0) {
+            fprintf(stderr, "Bad network: Expecting bandwidth from node %d to node %d\n",
+                    i / net->nodes + 1, i % net->nodes + 1);
+            return 0;
+        }
+    }
+
+    network = net;
+    return 1;
+}
+/***
+*Sends one message over the link between two nodes and returns the tick at which it arrives
+*A link with limited bandwidth hands out sending slots in order, so messages queue behind each other
+*/
+static long long message_transmit(int from, int to, long long now) {
+    if (network == NULL) {
+        return now;
+    }
+
+    int link = (from - 1) * network->nodes + (to - 1);
+    long long depart = now;
+    if (network->bandwidth[link] > 0) {
+        long long bandwidth = network->bandwidth[link];
+        long long slot = atomic_load(&network->next_slot[link]);
+        long long start;
+        do {
+            start = slot > now * bandwidth ? slot : now * bandwidth;
+        } while (!atomic_compare_exchange_weak(&network->next_slot[link], &slot, start + 1));
+        depart = start / bandwidth;
+    }
+
+    return depart < LLONG_MAX - network->latency[link] ? depart + network->latency[link] : LLONG_MAX;
+}
+/***
+*Returns the address of a process: its node times the address stride plus its id
+*/
+long long message_address(real_priority *proc) {
+    return (long long)proc->thread * address_stride + proc->id;
+}
+/***
+*Returns the registered process at an address, or NULL if there is none
+*/
+static real_priority *message_resident(long long addr) {
+    long long node = addr / address_stride;
+    long long id = addr % address_stride;
+    if (addr < 0 || node < 1 || node > inbox_count || id < 1 || id > inboxes[node].num_residents) {
+        return NULL;
+    }
+    return inboxes[node].residents[id - 1];
+}
+/***
+*Mixes the bits of an address so that neighbouring addresses spread over shards and slots
+*/
+static unsigned long long hash_address(long long addr) {
+    unsigned long long h = (unsigned long long)addr;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+/***
+*Hashes the sender and receiver address of a channel
+*/
+static unsigned long long hash_channel(long long sender_addr, long long receiver_addr) {
+    return hash_address(sender_addr ^ (long long)hash_address(receiver_addr));
+}
+/***
+*Returns true if a slot holds a channel
+*/
+static int slot_used(process_comm_table *slot) {
+    return slot->sender_waiting != NULL || slot->receiver_waiting != NULL || slot->count > 0;
+}
+/***
+*Returns the slot of a channel in a shard, or the free slot where it would go
+*The shard must be locked and must have at least one free slot
+*/
+static process_comm_table *shard_find(comm_shard *shard, long long sender_addr, long long receiver_addr,
+                                      unsigned long long hash) {
+    int mask = shard->capacity - 1;
+    for (int i = (hash >> SHARD_BITS) & mask; ; i = (i + 1) & mask) {
+        process_comm_table *slot = &shard->slots[i];
+        if (!slot_used(slot) || (slot->sender_addr == sender_addr && slot->receiver_addr == receiver_addr)) {
+            return slot;
+        }
+    }
+}
+/***
+*Doubles the number of slots in a shard and re-inserts its channels
+*/
+static void shard_grow(comm_shard *shard) {
+    process_comm_table *old = shard->slots;
+    int old_capacity = shard->capacity;
+
+    shard->capacity = old_capacity ? 2 * old_capacity : INITIAL_SLOTS;
+    shard->slots = calloc(shard->capacity, sizeof(process_comm_table));
+    assert(shard->slots != NULL);
+    for (int i = 0; i < old_capacity; i++) {
+        if (slot_used(&old[i])) {
+            unsigned long long hash = hash_channel(old[i].sender_addr, old[i].receiver_addr);
+            *shard_find(shard, old[i].sender_addr, old[i].receiver_addr, hash) = old[i];
+        }
+    }
+    free(old);
+}
+/***
+*Returns the channel from a sender to a receiver, locking its shard
+*The channel is created if it is not active yet. The caller unlocks with channel_release.
+*/
+static process_comm_table *channel_acquire(long long sender_addr, long long receiver_addr, comm_shard **locked) {
+    unsigned long long hash = hash_channel(sender_addr, receiver_addr);
+    comm_shard *shard = &coms_table[hash & (SHARDS - 1)];
+    pthread_mutex_lock(&(shard->lock));
+
+    /* Keep the load factor at or below one half so probe sequences stay short.
+     */
+    if (2 * (shard->used + 1) > shard->capacity) {
+        shard_grow(shard);
+    }
+
+    process_comm_table *slot = shard_find(shard, sender_addr, receiver_addr, hash);
+    if (!slot_used(slot)) {
+        slot->sender_addr = sender_addr;
+        slot->receiver_addr = receiver_addr;
+        slot->mailbox = NULL;
+        slot->head = 0;
+        shard->used++;
+    }
+    *locked = shard;
+    return slot;
+}
+/***
+*Unlocks the shard of a channel, removing the channel if it is no longer active
+*Removal shifts later slots of the probe sequence back, so no tombstones are needed
+*/
+static void channel_release(comm_shard *shard, process_comm_table *slot) {
+    if (!slot_used(slot)) {
+        int mask = shard->capacity - 1;
+        int hole = slot - shard->slots;
+        for (int i = (hole + 1) & mask; slot_used(&shard->slots[i]); i = (i + 1) & mask) {
+            process_comm_table *entry = &shard->slots[i];
+            int home = (hash_channel(entry->sender_addr, entry->receiver_addr) >> SHARD_BITS) & mask;
+            /* The entry can move into the hole if its home is not cyclically within (hole, i].
+             */
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                shard->slots[hole] = *entry;
+                hole = i;
+            }
+        }
+        shard->slots[hole].sender_waiting = NULL;
+        shard->slots[hole].receiver_waiting = NULL;
+        shard->slots[hole].count = 0;
+        shard->used--;
+    }
+    pthread_mutex_unlock(&(shard->lock));
+}
+/***
+*Appends an arrival tick to the mailbox of a channel, which must not be full
+*A ring is taken from the shard's free list, or allocated if the list is empty
+*/
+static void mailbox_put(comm_shard *shard, process_comm_table *table, long long arrival) {
+    assert(table->count < mailbox_size);
+    if (table->mailbox == NULL) {
+        if (shard->num_free_rings > 0) {
+            table->mailbox = shard->free_rings[--shard->num_free_rings];
+        } else {
+            table->mailbox = malloc(mailbox_size * sizeof(long long));
+            assert(table->mailbox != NULL);
+        }
+        table->head = 0;
+    }
+    table->mailbox[(table->head + table->count) % mailbox_size] = arrival;
+    table->count++;
+}
+/***
+*Removes and returns the oldest arrival tick in the mailbox of a channel, which must not be empty
+*The ring goes back to the shard's free list once it is empty
+*/
+static long long mailbox_take(comm_shard *shard, process_comm_table *table) {
+    assert(table->count > 0);
+    long long arrival = table->mailbox[table->head];
+    table->head = (table->head + 1) % mailbox_size;
+    table->count--;
+
+    if (table->count == 0) {
+        if (shard->num_free_rings == shard->max_free_rings) {
+            shard->max_free_rings = shard->max_free_rings ? 2 * shard->max_free_rings : INITIAL_SLOTS;
+            shard->free_rings = realloc(shard->free_rings, shard->max_free_rings * sizeof(long long *));
+            assert(shard->free_rings != NULL);
+        }
+        shard->free_rings[shard->num_free_rings++] = table->mailbox;
+        table->mailbox = NULL;
     }
-    ready_count = 0;
+    return arrival;
+}
+/***
+*Pushes a released process onto the inbox of its node, to be picked up once the given tick is reached
+*/
+static void message_deliver(real_priority *proc, long long arrival) {
+    assert(proc->node > 0 && proc->node <= inbox_count);
+    message_inbox *inbox = &inboxes[proc->node];
+
+    proc->msg_arrival = arrival;
+    if (arrival < sent_arrival) {
+        sent_arrival = arrival;
+    }
+
+    real_priority *head = atomic_load_explicit(&inbox->head, memory_order_relaxed);
+    do {
+        proc->msg_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&inbox->head, &head, proc,
+                                                    memory_order_release, memory_order_relaxed));
+}
+/***
+*Completes a rendezvous between a waiting and an arriving process
+*The sender goes on at once and the receiver once the message has crossed the network.
+*The pair is counted as in flight before the waiting side stops counting as waiting,
+*so message_pending never sees a moment where neither is counted
+*/
+static void message_match(real_priority *sender, real_priority *receiver, long long now) {
+    atomic_fetch_add(&in_flight_count, 2);
+    message_deliver(sender, now);
+    message_deliver(receiver, message_transmit(sender->node, receiver->node, now));
+    atomic_fetch_sub(&waiting_count, 1);
+}
+/***
+*Hands a process back to its node, to be picked up once the given tick is reached
+*If the process was waiting it stops counting as waiting
+*/
+static void message_release(real_priority *proc, long long arrival, int was_waiting) {
+    atomic_fetch_add(&in_flight_count, 1);
+    message_deliver(proc, arrival);
+    if (was_waiting) {
+        atomic_fetch_sub(&waiting_count, 1);
+    }
+}
+/***
+*Orders processes by id
+*/
+static int compare_id(const void *a, const void *b) {
+    const real_priority *x = *(real_priority * const *)a;
+    const real_priority *y = *(real_priority * const *)b;
+    return (x->id > y->id) - (x->id < y->id);
 }
 /***
 *This function is responsible for sending message if reciever is waiting
 *If the reciever is not ready sender waits
 */
-void send_message(real_priority *sender, int receiver_addr) {
-    int sender_addr = sender->thread * 100 + sender->id;
-    int idx = sender_addr;
-    process_comm_table *table = &coms_table[idx];
+void send_message(real_priority *sender, long long receiver_addr, long long now) {
+    comm_shard *shard;
+    process_comm_table *table = channel_acquire(message_address(sender), receiver_addr, &shard);
 
-    pthread_mutex_lock(&(table->lock));
+    if (table->receiver_waiting) {
+        message_match(sender, table->receiver_waiting, now);
+        table->receiver_waiting = NULL;
+    }
+    else {
+        atomic_fetch_add(&waiting_count, 1);
+        table->sender_waiting = sender;
+    }
+    channel_release(shard, table);
+}
+/***
+*This function is responsible for sending a buffered message
+*A waiting reciever gets the message directly, otherwise it is left in the mailbox of the channel,
+*crossing the link to the node the reciever runs on at the time, which may not be its address's node
+*The sender only waits if the mailbox is full, until the reciever takes a message
+*Returns 1 if the sender has to wait and 0 if it can go on
+*/
+int send_message_async(real_priority *sender, long long receiver_addr, long long now) {
+    comm_shard *shard;
+    process_comm_table *table = channel_acquire(message_address(sender), receiver_addr, &shard);
 
-    if (table->receiver_waiting && table->receiver_addr == sender_addr) {
-        pthread_mutex_lock(&ready_lock);
-        ready_list[ready_count++] = table->receiver_waiting;
-        ready_list[ready_count++] = sender;
-        pthread_mutex_unlock(&ready_lock);
+    int blocked = 0;
+    if (table->receiver_waiting) {
+        real_priority *receiver = table->receiver_waiting;
+        message_release(receiver, message_transmit(sender->node, receiver->node, now), 1);
         table->receiver_waiting = NULL;
-        table->receiver_addr = 0;
+    }
+    else if (table->count < mailbox_size) {
+        real_priority *receiver = message_resident(receiver_addr);
+        int node = receiver ? receiver->node : (int)(receiver_addr / address_stride);
+        mailbox_put(shard, table, message_transmit(sender->node, node, now));
     }
     else {
+        atomic_fetch_add(&waiting_count, 1);
         table->sender_waiting = sender;
-        table->sender_addr = receiver_addr;
+        blocked = 1;
     }
-    pthread_mutex_unlock(&(table->lock));
+    channel_release(shard, table);
+    return blocked;
 }
 /***
 *This function is responsible for recieving message from a sender
-*If the sender is waiting both are turned into ready
+*A message in the mailbox is taken first, making room for a sender waiting on a full mailbox.
+*If that message is still crossing the network, the reciever waits for it to arrive.
+*Otherwise, if the sender is waiting in SEND both are turned into ready
 *else the reciver waits till the sender sends message
+*Returns 1 if the reciever has to wait and 0 if it can go on
 */
-void receive_message(real_priority *receiver, int sender_addr) {
-    int receiver_addr = receiver->thread * 100 + receiver->id;
-    int idx = sender_addr;
-    process_comm_table *table = &coms_table[idx];
-
-    pthread_mutex_lock(&(table->lock));
+int receive_message(real_priority *receiver, long long sender_addr, long long now) {
+    comm_shard *shard;
+    process_comm_table *table = channel_acquire(sender_addr, message_address(receiver), &shard);
 
-    if (table->sender_waiting && table->sender_addr == receiver_addr) {
-        pthread_mutex_lock(&ready_lock);
-        ready_list[ready_count++] = table->sender_waiting;
-        ready_list[ready_count++] = receiver;
-        pthread_mutex_unlock(&ready_lock);
+    int blocked = 1;
+    if (table->count > 0) {
+        long long arrival = mailbox_take(shard, table);
+        real_priority *sender = table->sender_waiting;
+        if (sender && context_cur_op(sender) == OP_ASEND) {
+            /* The sender was waiting on a full mailbox, its message now fits and is sent.
+             * A sender waiting in SEND keeps waiting until the mailbox is empty.
+             */
+            mailbox_put(shard, table, message_transmit(sender->node, receiver->node, now));
+            message_release(sender, now, 1);
+            table->sender_waiting = NULL;
+        }
+        if (arrival > now) {
+            message_release(receiver, arrival, 0);
+        } else {
+            blocked = 0;
+        }
+    }
+    else if (table->sender_waiting) {
+        message_match(table->sender_waiting, receiver, now);
         table->sender_waiting = NULL;
-        table->sender_addr = 0;
     }
     else {
+        atomic_fetch_add(&waiting_count, 1);
         table->receiver_waiting = receiver;
-        table->receiver_addr = sender_addr;
     }
-    pthread_mutex_unlock(&(table->lock));
+    channel_release(shard, table);
+    return blocked;
 }
 /***
-*Returns the processes in an array which has just become ready
-*Removes those process from the global ready list
+*Returns true if the primitive is a collective one
 */
-real_priority **message_ready(int *num_ready, int node_id) {
-    static real_priority *local_ready[MAX_PROCS];
-    int count = 0;
+static int is_collective(int op) {
+    return op == OP_BCAST || op == OP_GATHER || op == OP_BARRIER;
+}
+/***
+*Returns the slot of a group in the group table, or the free slot where it would go
+*/
+static collective_group **group_find(int op, long long arg) {
+    int mask = group_capacity - 1;
+    for (int i = hash_channel(op, arg) & mask; ; i = (i + 1) & mask) {
+        if (groups[i] == NULL || (groups[i]->op == op && groups[i]->arg == arg)) {
+            return &groups[i];
+        }
+    }
+}
+/***
+*Doubles the size of the group table and re-inserts its groups
+*/
+static void group_grow() {
+    collective_group **old = groups;
+    int old_capacity = group_capacity;
+
+    group_capacity = old_capacity ? 2 * old_capacity : INITIAL_SLOTS;
+    groups = calloc(group_capacity, sizeof(collective_group *));
+    assert(groups != NULL);
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i]) {
+            *group_find(old[i]->op, old[i]->arg) = old[i];
+        }
+    }
+    free(old);
+}
+/***
+*Records a process under its address, and adds it to the group of every collective primitive in its code
+*Every process must be registered before the simulation starts, so that each group knows its size
+*/
+void message_register(real_priority *proc) {
+    pthread_mutex_lock(&group_lock);
+    message_inbox *home = &inboxes[proc->thread];
+    if (proc->id > home->num_residents) {
+        home->residents = realloc(home->residents, proc->id * sizeof(real_priority *));
+        assert(home->residents != NULL);
+        memset(home->residents + home->num_residents, 0,
+               (proc->id - home->num_residents) * sizeof(real_priority *));
+        home->num_residents = proc->id;
+    }
+    home->residents[proc->id - 1] = proc;
+
+    for (int ip = 0; proc->code[ip].op != OP_HALT; ip++) {
+        int op = proc->code[ip].op;
+        if (!is_collective(op)) {
+            continue;
+        }
 
-    pthread_mutex_lock(&ready_lock);
-    int new_ready_count = 0;
-    for (int i = 0; i < ready_count; i++) {
-        if (ready_list[i]->thread == node_id) {
-            local_ready[count++] = ready_list[i];
+        if (2 * (group_count + 1) > group_capacity) {
+            group_grow();
         }
-        else {
-            ready_list[new_ready_count++] = ready_list[i];
+        collective_group **slot = group_find(op, proc->code[ip].arg);
+        if (*slot == NULL) {
+            *slot = calloc(1, sizeof(collective_group));
+            assert(*slot != NULL);
+            (*slot)->op = op;
+            (*slot)->arg = proc->code[ip].arg;
+            pthread_mutex_init(&(*slot)->lock, NULL);
+            group_count++;
+        }
+
+        collective_group *group = *slot;
+        if (group->last_member != proc) {
+            group->last_member = proc;
+            group->size++;
+            group->members = realloc(group->members, group->size * sizeof(real_priority *));
+            group->ticks = realloc(group->ticks, group->size * sizeof(long long));
+            assert(group->members != NULL && group->ticks != NULL);
+        }
+    }
+    pthread_mutex_unlock(&group_lock);
+}
+/***
+*Computes the tick at which each member of a completed round is released
+*Messages follow a binomial tree rooted at the first member: the parent of member r is r with
+*its lowest set bit cleared, so a round takes a logarithmic number of link crossings.
+*BCAST sends down the tree, GATHER combines up the tree into the root, and BARRIER does both.
+*/
+static void group_schedule(collective_group *group, long long now) {
+    real_priority **members = group->members;
+    long long *ticks = group->ticks;
+    int n = group->size;
+
+    for (int r = 0; r < n; r++) {
+        ticks[r] = now;
+    }
+    if (group->op == OP_GATHER || group->op == OP_BARRIER) {
+        /* Children have higher ranks than their parent, so they have all reported first.
+         */
+        for (int r = n - 1; r > 0; r--) {
+            int parent = r & (r - 1);
+            long long arrival = message_transmit(members[r]->node, members[parent]->node, ticks[r]);
+            if (arrival > ticks[parent]) {
+                ticks[parent] = arrival;
+            }
+        }
+        if (group->op == OP_GATHER) {
+            return;
+        }
+    }
+    for (int r = 1; r < n; r++) {
+        int parent = r & (r - 1);
+        ticks[r] = message_transmit(members[parent]->node, members[r]->node, ticks[parent]);
+    }
+}
+/***
+*This function is responsible for a process arriving at a BCAST, GATHER or BARRIER
+*Every member waits until the whole group has arrived. The last one to arrive releases the others,
+*each once the messages of the collective have reached it. BCAST counts as a send for the root
+*and a receive for the others, GATHER the other way round.
+*Returns 1 if the process has to wait and 0 if it can go on
+*/
+int message_collective(real_priority *proc, long long now) {
+    int op = context_cur_op(proc);
+    long long arg = context_cur_address(proc);
+    collective_group *group = group_capacity ? *group_find(op, arg) : NULL;
+    assert(group != NULL && group->size > 0);
+
+    if (op != OP_BARRIER) {
+        int root = message_address(proc) == arg;
+        if ((op == OP_BCAST) == root) {
+            proc->send_count++;
+        } else {
+            proc->recv_count++;
         }
     }
 
-    ready_count = new_ready_count;
-    pthread_mutex_unlock(&ready_lock);
+    pthread_mutex_lock(&group->lock);
+    group->members[group->arrived++] = proc;
+    if (group->arrived < group->size) {
+        atomic_fetch_add(&waiting_count, 1);
+        pthread_mutex_unlock(&group->lock);
+        return 1;
+    }
 
-    for (int i = 0; i < count - 1; i++) {
-        for (int j = i + 1; j < count; j++) {
-            if (local_ready[i]->id > local_ready[j]->id) {
-                real_priority *tmp = local_ready[i];
-                local_ready[i] = local_ready[j];
-                local_ready[j] = tmp;
+    /* The root of a BCAST or GATHER goes first in the tree; if it is not a member,
+     * the first process to arrive stands in for it.
+     */
+    real_priority **members = group->members;
+    if (op != OP_BARRIER) {
+        for (int r = 1; r < group->size; r++) {
+            if (message_address(members[r]) == arg) {
+                real_priority *root = members[r];
+                members[r] = members[0];
+                members[0] = root;
+                break;
             }
         }
     }
+    group_schedule(group, now);
+
+    int blocked = 0;
+    for (int r = 0; r < group->size; r++) {
+        if (members[r] != proc) {
+            message_release(members[r], group->ticks[r], 1);
+        } else if (group->ticks[r] > now) {
+            message_release(proc, group->ticks[r], 0);
+            blocked = 1;
+        }
+    }
+    group->arrived = 0;
+    pthread_mutex_unlock(&group->lock);
+    return blocked;
+}
+/***
+*Moves everything in a node's inbox to its arrival queue
+*Only the node's own thread may call this
+*/
+static void message_drain(message_inbox *inbox) {
+    real_priority *proc = atomic_exchange_explicit(&inbox->head, NULL, memory_order_acquire);
+    while (proc) {
+        real_priority *next = proc->msg_next;
+        prio_q_add_node(inbox->arrivals, &proc->link, proc, proc->msg_arrival);
+        proc = next;
+    }
+}
+/***
+*Returns the processes of a node whose message has arrived by the given tick, sorted by id
+*The array belongs to the node and is reused on its next call
+*/
+real_priority **message_ready(int *num_ready, int node_id, long long now) {
+    assert(node_id > 0 && node_id <= inbox_count);
+    message_inbox *inbox = &inboxes[node_id];
+    int count = 0;
+
+    message_drain(inbox);
+    while (!prio_q_empty(inbox->arrivals) &&
+           ((real_priority *)prio_q_peek(inbox->arrivals))->msg_arrival <= now) {
+        if (count == inbox->capacity) {
+            inbox->capacity = inbox->capacity ? 2 * inbox->capacity : 2 * MAX_PROCS;
+            inbox->ready = realloc(inbox->ready, inbox->capacity * sizeof(real_priority *));
+            assert(inbox->ready != NULL);
+        }
+        inbox->ready[count++] = prio_q_remove(inbox->arrivals);
+    }
+
+    if (count > 0) {
+        atomic_fetch_sub(&in_flight_count, count);
+        qsort(inbox->ready, count, sizeof(real_priority *), compare_id);
+    }
     *num_ready = count;
-    return local_ready;
+    return inbox->ready;
+}
+/***
+*Returns the earliest tick after now at which a message may release a process: on the given node,
+*or on any node this thread has sent to since it last called this function.
+*Every thread reports its sends this way, so the earliest report over all threads covers every message.
+*Returns LLONG_MAX if there is none
+*/
+long long message_next_arrival(int node_id, long long now) {
+    assert(node_id > 0 && node_id <= inbox_count);
+    message_inbox *inbox = &inboxes[node_id];
+
+    message_drain(inbox);
+    long long next = sent_arrival;
+    sent_arrival = LLONG_MAX;
+    if (!prio_q_empty(inbox->arrivals)) {
+        real_priority *first = prio_q_peek(inbox->arrivals);
+        if (first->msg_arrival < next) {
+            next = first->msg_arrival;
+        }
+    }
+    if (next == LLONG_MAX) {
+        return LLONG_MAX;
+    }
+    return next <= now ? now + 1 : next;
 }
 /***
 *Returns true if any process is waiting or else otherwise
-*
+*A single load of each counter, so the cost does not depend on the number of channels
+*The waiting count is read first: a match adds to the in-flight count before it takes away
+*from the waiting count, so a pair that is matched in between is still seen
+*Messages left in mailboxes do not count, as nobody may ever receive them
 */
 int message_pending() {
-    for (int i = 0; i < MAX_CONTEXTS; i++) {
-        pthread_mutex_lock(&(coms_table[i].lock));
-        if (coms_table[i].sender_waiting != NULL || coms_table[i].receiver_waiting != NULL) {
-            pthread_mutex_unlock(&(coms_table[i].lock));
-            return 1;
-        }
-        pthread_mutex_unlock(&(coms_table[i].lock));
-    }
-    pthread_mutex_lock(&ready_lock);
-    int has_global_ready = (ready_count > 0);
-    pthread_mutex_unlock(&ready_lock);
-    return has_global_ready;
-}
\ No newline at end of file
+    return atomic_load(&waiting_count) > 0 || atomic_load(&in_flight_count) > 0;
+}
+/***
+*Returns true if a released process is waiting to be picked up by its node
+*/
+int message_in_flight() {
+    return atomic_load(&in_flight_count) > 0;
+}
+//Saved settings and counters of the message module. They are followed by the network, if any,
+//then the channels, the collective rounds in progress and the processes on their way to a node.
+typedef struct {
+    long long address_stride;
+    int mailbox_size;
+    int nodes;
+    int network_nodes;          /* 0 without a network */
+    int waiting_count;
+    int in_flight_count;
+    int num_channels;
+    int num_rounds;
+    int num_delivered;
+} message_record;
+
+//Saved channel, followed by the arrival ticks in its mailbox, oldest first
+typedef struct {
+    long long sender_addr;
+    long long receiver_addr;
+    int sender_waiting;         /* process index or -1 */
+    int receiver_waiting;
+    int count;
+} channel_record;
+
+//Saved collective round, followed by the indices of the members that have arrived
+typedef struct {
+    long long arg;
+    int op;
+    int arrived;
+} round_record;
+
+/***
+*Appends every process in a queue to the array being saved
+*/
+static int save_arrivals(prio_q_t *arrivals, int *indices) {
+    for (int i = 0; i < arrivals->size; i++) {
+        indices[i] = checkpoint_index(arrivals->heap[i]->contents);
+    }
+    return arrivals->size;
+}
+/***
+*Saves the state of the message system. Must be called between two rounds, while no node runs.
+*Released processes are saved with their arrival tick, whether or not their node has drained its inbox.
+*/
+void message_save(checkpoint_t *ck) {
+    message_record settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.address_stride = address_stride;
+    settings.mailbox_size = mailbox_size;
+    settings.nodes = inbox_count;
+    settings.network_nodes = network ? network->nodes : 0;
+    settings.waiting_count = atomic_load(&waiting_count);
+    settings.in_flight_count = atomic_load(&in_flight_count);
+    for (int i = 0; i < SHARDS; i++) {
+        settings.num_channels += coms_table[i].used;
+    }
+    for (int i = 0; i < group_capacity; i++) {
+        settings.num_rounds += groups[i] && groups[i]->arrived > 0;
+    }
+    for (int i = 1; i <= inbox_count; i++) {
+        message_drain(&inboxes[i]);
+        settings.num_delivered += inboxes[i].arrivals->size;
+    }
+    checkpoint_put(ck, &settings, sizeof(settings));
+
+    if (network) {
+        int links = network->nodes * network->nodes;
+        long long *slots = malloc(links * sizeof(long long));
+        assert(slots);
+        for (int i = 0; i < links; i++) {
+            slots[i] = atomic_load(&network->next_slot[i]);
+        }
+        checkpoint_put(ck, network->latency, links * sizeof(int));
+        checkpoint_put(ck, network->bandwidth, links * sizeof(int));
+        checkpoint_put(ck, slots, links * sizeof(long long));
+        free(slots);
+    }
+
+    long long *ring = malloc(mailbox_size * sizeof(long long));
+    assert(ring);
+    for (int i = 0; i < SHARDS; i++) {
+        comm_shard *shard = &coms_table[i];
+        for (int j = 0; j < shard->capacity; j++) {
+            process_comm_table *slot = &shard->slots[j];
+            if (!slot_used(slot)) {
+                continue;
+            }
+            channel_record channel = {slot->sender_addr, slot->receiver_addr,
+                                      checkpoint_index(slot->sender_waiting),
+                                      checkpoint_index(slot->receiver_waiting), slot->count};
+            checkpoint_put(ck, &channel, sizeof(channel));
+            for (int k = 0; k < slot->count; k++) {
+                ring[k] = slot->mailbox[(slot->head + k) % mailbox_size];
+            }
+            checkpoint_put(ck, ring, slot->count * sizeof(long long));
+        }
+    }
+    free(ring);
+
+    for (int i = 0; i < group_capacity; i++) {
+        collective_group *group = groups[i];
+        if (group && group->arrived > 0) {
+            round_record round = {group->arg, group->op, group->arrived};
+            int *members = malloc(group->arrived * sizeof(int));
+            assert(members);
+            for (int r = 0; r < group->arrived; r++) {
+                members[r] = checkpoint_index(group->members[r]);
+            }
+            checkpoint_put(ck, &round, sizeof(round));
+            checkpoint_put(ck, members, group->arrived * sizeof(int));
+            free(members);
+        }
+    }
+
+    int *delivered = malloc((settings.num_delivered + 1) * sizeof(int));
+    assert(delivered);
+    int count = 0;
+    for (int i = 1; i <= inbox_count; i++) {
+        count += save_arrivals(inboxes[i].arrivals, delivered + count);
+    }
+    checkpoint_put(ck, delivered, count * sizeof(int));
+    free(delivered);
+}
+/***
+*Restores the message system saved by message_save, once the processes are restored.
+*Every admitted process is registered with its collective groups again, in input order as when it was admitted.
+*Returns 1 on success, 0 if the checkpoint is damaged
+*/
+int message_restore(checkpoint_t *ck) {
+    const message_record *settings = checkpoint_get(ck, sizeof(message_record));
+    if (!settings || settings->address_stride <= 0 || settings->mailbox_size <= 0 || settings->nodes <= 0 ||
+        (settings->network_nodes != 0 && settings->network_nodes < settings->nodes)) {
+        return 0;
+    }
+    create_message(settings->nodes, settings->address_stride, settings->mailbox_size);
+    /* Processes of a node outside the simulation were never admitted, so they cannot have moved
+     */
+    for (int i = 0; i < ck->num_procs; i++) {
+        real_priority *proc = ck->procs[i];
+        if (proc->thread >= 1 && proc->thread <= inbox_count) {
+            if (proc->node < 1 || proc->node > inbox_count) {
+                return 0;
+            }
+            message_register(proc);
+        }
+        else if (proc->node != proc->thread) {
+            return 0;
+        }
+    }
+
+    if (settings->network_nodes) {
+        int links = settings->network_nodes * settings->network_nodes;
+        const int *latency = checkpoint_get(ck, links * sizeof(int));
+        const int *bandwidth = checkpoint_get(ck, links * sizeof(int));
+        const long long *slots = checkpoint_get(ck, links * sizeof(long long));
+        if (!latency || !bandwidth || !slots) {
+            return 0;
+        }
+        network_model *net = calloc(1, sizeof(network_model));
+        assert(net);
+        net->nodes = settings->network_nodes;
+        net->latency = malloc(links * sizeof(int));
+        net->bandwidth = malloc(links * sizeof(int));
+        net->next_slot = malloc(links * sizeof(*net->next_slot));
+        assert(net->latency && net->bandwidth && net->next_slot);
+        memcpy(net->latency, latency, links * sizeof(int));
+        memcpy(net->bandwidth, bandwidth, links * sizeof(int));
+        for (int i = 0; i < links; i++) {
+            atomic_init(&net->next_slot[i], slots[i]);
+        }
+        network = net;
+    }
+
+    for (int i = 0; i < settings->num_channels; i++) {
+        const channel_record *channel = checkpoint_get(ck, sizeof(channel_record));
+        if (!channel || channel->count < 0 || channel->count > mailbox_size) {
+            return 0;
+        }
+        const long long *ring = checkpoint_get(ck, channel->count * sizeof(long long));
+        real_priority *sender;
+        real_priority *receiver;
+        if (!ring || !checkpoint_proc(ck, channel->sender_waiting, &sender) ||
+            !checkpoint_proc(ck, channel->receiver_waiting, &receiver)) {
+            return 0;
+        }
+
+        comm_shard *shard;
+        process_comm_table *table = channel_acquire(channel->sender_addr, channel->receiver_addr, &shard);
+        table->sender_waiting = sender;
+        table->receiver_waiting = receiver;
+        for (int k = 0; k < channel->count; k++) {
+            mailbox_put(shard, table, ring[k]);
+        }
+        channel_release(shard, table);
+    }
+
+    for (int i = 0; i < settings->num_rounds; i++) {
+        const round_record *round = checkpoint_get(ck, sizeof(round_record));
+        const int *members = round ? checkpoint_get(ck, round->arrived * sizeof(int)) : NULL;
+        collective_group *group = members && group_capacity ? *group_find(round->op, round->arg) : NULL;
+        if (!group || round->arrived > group->size) {
+            return 0;
+        }
+        for (int r = 0; r < round->arrived; r++) {
+            if (!checkpoint_proc(ck, members[r], &group->members[r]) || !group->members[r]) {
+                return 0;
+            }
+        }
+        group->arrived = round->arrived;
+    }
+
+    const int *delivered = checkpoint_get(ck, settings->num_delivered * sizeof(int));
+    if (!delivered) {
+        return 0;
+    }
+    for (int i = 0; i < settings->num_delivered; i++) {
+        real_priority *proc;
+        if (!checkpoint_proc(ck, delivered[i], &proc) || !proc || proc->node <= 0 || proc->node > inbox_count) {
+            return 0;
+        }
+        prio_q_add_node(inboxes[proc->node].arrivals, &proc->link, proc, proc->msg_arrival);
+    }
+
+    atomic_store(&waiting_count, settings->waiting_count);
+    atomic_store(&in_flight_count, settings->in_flight_count);
+    return 1;
+}
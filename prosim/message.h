@@ -6,10 +6,20 @@
 #define MESSAGE_H
 #include "context.h"
 
-void create_message();
-void send_message(real_priority *sender, int receiver_addr);
-void receive_message(real_priority *receiver, int sender_addr);
-real_priority **message_ready(int *num_ready,int node_id);
+void create_message(int num_nodes, long long address_stride, int mailbox_size);
+int message_load_network(FILE *fin);
+long long message_address(real_priority *proc);
+void send_message(real_priority *sender, long long receiver_addr, long long now);
+int send_message_async(real_priority *sender, long long receiver_addr, long long now);
+int receive_message(real_priority *receiver, long long sender_addr, long long now);
+void message_register(real_priority *proc);
+int message_collective(real_priority *proc, long long now);
+real_priority **message_ready(int *num_ready, int node_id, long long now);
+long long message_next_arrival(int node_id, long long now);
 int message_pending();
-static int pair_index(int sender_addr, int receiver_addr);
+int message_in_flight();
+
+struct checkpoint;
+void message_save(struct checkpoint *ck);
+int message_restore(struct checkpoint *ck);
 #endif
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include "message.h"
+
+/* Micro-benchmark comparing the old table-scanning message_pending with the counters in message.c
+ * Build with: make bench   (or gcc -O2 -o msg_bench msg_bench.c message.c context.c loader.c prio_q.c checkpoint.c -l pthread)
+ *
+ * Every node calls message_pending once per tick, so its cost is a per-tick cost of the simulation.
+ * The old check locked every entry of the rendezvous table in turn; it is timed here on tables of
+ * growing size with nothing waiting, which is the common case and also its worst case.
+ */
+
+/* The rendezvous table scan that message.c used to implement, kept here only for comparison.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    real_priority *sender_waiting;
+    real_priority *receiver_waiting;
+} scan_entry;
+
+static int scan_pending(scan_entry *table, int n) {
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&table[i].lock);
+        if (table[i].sender_waiting != NULL || table[i].receiver_waiting != NULL) {
+            pthread_mutex_unlock(&table[i].lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&table[i].lock);
+    }
+    return 0;
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Returns nanoseconds per check when scanning a table of n entries.
+ */
+static double bench_scan(int n, int ticks) {
+    scan_entry *table = calloc(n, sizeof(scan_entry));
+    assert(table != NULL);
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&table[i].lock, NULL);
+    }
+
+    int pending = 0;
+    double start = now_sec();
+    for (int i = 0; i < ticks; i++) {
+        pending += scan_pending(table, n);
+    }
+    double ns = (now_sec() - start) * 1e9 / ticks;
+    assert(pending == 0);
+    free(table);
+    return ns;
+}
+
+/* Returns nanoseconds per check using the counters.
+ */
+static double bench_counters(int ticks) {
+    int pending = 0;
+    double start = now_sec();
+    for (int i = 0; i < ticks; i++) {
+        pending += message_pending();
+    }
+    double ns = (now_sec() - start) * 1e9 / ticks;
+    assert(pending == 0);
+    return ns;
+}
+
+/* Checks that the counters follow a rendezvous from waiting, to in flight, to picked up.
+ */
+static int check_counts() {
+    real_priority *sender = calloc(1, sizeof(real_priority));
+    real_priority *receiver = calloc(1, sizeof(real_priority));
+    assert(sender != NULL && receiver != NULL);
+    sender->thread = 1;
+    sender->node = 1;
+    sender->id = 1;
+    receiver->thread = 2;
+    receiver->node = 2;
+    receiver->id = 1;
+
+    create_message(2, 100, 16);
+    if (message_pending() || message_in_flight()) {
+        return 0;
+    }
+
+    receive_message(receiver, 101, 0);
+    if (!message_pending() || message_in_flight()) {
+        return 0;
+    }
+
+    send_message(sender, 201, 0);
+    if (!message_pending() || !message_in_flight()) {
+        return 0;
+    }
+
+    int num_ready = 0;
+    message_ready(&num_ready, 1, 0);
+    if (num_ready != 1 || !message_pending()) {
+        return 0;
+    }
+    message_ready(&num_ready, 2, 0);
+    if (num_ready != 1 || message_pending() || message_in_flight()) {
+        return 0;
+    }
+
+    free(sender);
+    free(receiver);
+    return 1;
+}
+
+/* Checks that many channels can wait at once on a large address space and that every
+ * pair is delivered to the right node exactly once.
+ */
+static int check_many() {
+    const int nodes = 1000;
+    const int per_node = 200;
+    const long long stride = 10000000;
+    int n = nodes * per_node;
+    real_priority *procs = calloc(2 * n, sizeof(real_priority));
+    assert(procs != NULL);
+
+    /* Receiver i on node i % nodes waits for sender i on the node after it.
+     */
+    create_message(nodes, stride, 16);
+    for (int i = 0; i < n; i++) {
+        real_priority *receiver = &procs[i];
+        real_priority *sender = &procs[n + i];
+        receiver->thread = i % nodes + 1;
+        receiver->node = receiver->thread;
+        receiver->id = i / nodes + 1;
+        sender->thread = (i + 1) % nodes + 1;
+        sender->node = sender->thread;
+        sender->id = per_node + i / nodes + 1;
+        receive_message(receiver, message_address(sender), 0);
+    }
+    if (message_in_flight()) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        send_message(&procs[n + i], message_address(&procs[i]), 0);
+    }
+
+    int delivered = 0;
+    for (int node = 1; node <= nodes; node++) {
+        int num_ready = 0;
+        real_priority **ready = message_ready(&num_ready, node, 0);
+        for (int i = 0; i < num_ready; i++) {
+            if (ready[i]->thread != node || (i > 0 && ready[i - 1]->id >= ready[i]->id)) {
+                return 0;
+            }
+        }
+        delivered += num_ready;
+    }
+    free(procs);
+    return delivered == 2 * n && !message_pending();
+}
+
+/* Checks that buffered sends only block on a full mailbox, that a receive takes the oldest
+ * message first, and that taking a message lets a blocked sender's message in.
+ */
+static int check_mailbox() {
+    real_priority *sender = calloc(1, sizeof(real_priority));
+    real_priority *receiver = calloc(1, sizeof(real_priority));
+    opcode asend = {.op = OP_ASEND, .arg = 201};
+    assert(sender != NULL && receiver != NULL);
+    sender->thread = 1;
+    sender->node = 1;
+    sender->id = 1;
+    sender->code = &asend;
+    receiver->thread = 2;
+    receiver->node = 2;
+    receiver->id = 1;
+
+    create_message(2, 100, 4);
+    for (int i = 0; i < 4; i++) {
+        if (send_message_async(sender, 201, i)) {
+            return 0;
+        }
+    }
+    if (!send_message_async(sender, 201, 4) || !message_pending()) {
+        return 0;
+    }
+
+    /* Five receives empty the mailbox, the first one releasing the sender.
+     */
+    int num_ready = 0;
+    for (int i = 0; i < 5; i++) {
+        if (receive_message(receiver, 101, 5)) {
+            return 0;
+        }
+        message_ready(&num_ready, 1, 5);
+        if (num_ready != (i == 0)) {
+            return 0;
+        }
+    }
+    if (message_pending()) {
+        return 0;
+    }
+
+    /* The next receive waits and a buffered send hands it the message directly.
+     */
+    if (!receive_message(receiver, 101, 5) || send_message_async(sender, 201, 5)) {
+        return 0;
+    }
+    message_ready(&num_ready, 2, 5);
+    if (num_ready != 1 || message_pending()) {
+        return 0;
+    }
+
+    free(sender);
+    free(receiver);
+    return 1;
+}
+
+int main() {
+    printf("Rendezvous counts: %s\n", check_counts() ? "ok" : "BROKEN");
+    printf("Many channels: %s\n", check_many() ? "ok" : "BROKEN");
+    printf("Mailboxes: %s\n", check_mailbox() ? "ok" : "BROKEN");
+    printf("%10s %14s %16s\n", "entries", "scan ns/tick", "counter ns/tick");
+
+    for (int n = 100; n <= 1000000; n *= 10) {
+        /* The scan is O(n) per tick, so cap its work to keep the run short.
+         */
+        int scan_ticks = n >= 100000 ? 100 : 10000;
+        int counter_ticks = 10000000;
+
+        double scan_ns = bench_scan(n, scan_ticks);
+        double counter_ns = bench_counters(counter_ticks);
+        printf("%10d %14.1f %16.1f\n", n, scan_ns, counter_ns);
+    }
+    return 0;
+}
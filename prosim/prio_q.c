@@ -1,10 +1,9 @@
 
-
 #include <stdlib.h>
-#include <string.h>
 #include <assert.h>
 #include "prio_q.h"
 
+#define INITIAL_CAPACITY 16
 
 /* Creates an empty priority queue and returns a pointer to it.
  * @params:
@@ -18,72 +17,204 @@ extern prio_q_t *prio_q_new() {
     return list;
 }
 
-/* Allocate a new node to be inserted into queue and initialize it.
+/* Returns true if node a should be closer to the head of the queue than node b.
+ * @params:
+ *   a, b : nodes to compare
+ * @returns:
+ *   1 if a has a lower priority, or equal priority and was inserted earlier, 0 otherwise
+ */
+static inline int node_before(const node_t *a, const node_t *b) {
+    return a->priority < b->priority || (a->priority == b->priority && a->seq < b->seq);
+}
+
+/* Stores a node at index i of the heap and records the index in the node.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   i : index in the heap
+ *   node : node to be stored
+ * @returns:
+ *   none
+ */
+static inline void heap_set(prio_q_t *queue, int i, node_t *node) {
+    queue->heap[i] = node;
+    node->pos = i;
+}
+
+/* Moves the node at index i towards the root until the heap order is restored.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   i : index of the node to sift up
+ * @returns:
+ *   none
+ */
+static void sift_up(prio_q_t *queue, int i) {
+    node_t *node = queue->heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!node_before(node, queue->heap[parent])) {
+            break;
+        }
+        heap_set(queue, i, queue->heap[parent]);
+        i = parent;
+    }
+    heap_set(queue, i, node);
+}
+
+/* Moves the node at index i towards the leaves until the heap order is restored.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   i : index of the node to sift down
+ * @returns:
+ *   none
+ */
+static void sift_down(prio_q_t *queue, int i) {
+    node_t *node = queue->heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= queue->size) {
+            break;
+        }
+        if (child + 1 < queue->size && node_before(queue->heap[child + 1], queue->heap[child])) {
+            child++;
+        }
+        if (!node_before(queue->heap[child], node)) {
+            break;
+        }
+        heap_set(queue, i, queue->heap[child]);
+        i = child;
+    }
+    heap_set(queue, i, node);
+}
+
+/* Allocate a new node from the queue's pool.
  * @params:
  *   queue : pointer to the priority queue
- *   contents : pointer to item to be enqueued
- *   priority : item's priority
  * @returns:
  *   pointer to new node.
  */
-static node_t *new_node(prio_q_t *queue, void *contents, int priority) {
+static node_t *new_node(prio_q_t *queue) {
     assert(queue != NULL);
 
     /* If our free list has free nodes, use one of them
-     * Otherwise, allocate a new mpde.
+     * Otherwise, allocate a new node.
      */
     node_t * node = queue->free;
     if (!node) {
         node = calloc(1, sizeof(node_t));
     } else {
         queue->free = queue->free->next;
-        memset(node, 0, sizeof(node_t));
     }
 
     /* Assume we have a node and initialize it
      */
     assert(node != NULL);
+    node->external = 0;
+    return node;
+}
+
+/* Initialize a node and link it into the heap.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   node : node to be linked
+ *   contents : pointer to item to be enqueued
+ *   priority : item's priority
+ *   seq : item's insertion order
+ * @returns:
+ *   none
+ */
+static void heap_link(prio_q_t *queue, node_t *node, void *contents, long long priority, unsigned long seq) {
+    node->next = NULL;
     node->contents = contents;
     node->priority = priority;
-    return node;
+    node->seq = seq;
+
+    /* Grow the heap array if it is full. Assume the allocation is successful.
+     */
+    if (queue->size == queue->capacity) {
+        queue->capacity = queue->capacity ? 2 * queue->capacity : INITIAL_CAPACITY;
+        queue->heap = realloc(queue->heap, queue->capacity * sizeof(node_t *));
+        assert(queue->heap != NULL);
+    }
+
+    /* Place the new node in the first free leaf and let it rise to its place.
+     */
+    heap_set(queue, queue->size++, node);
+    sift_up(queue, node->pos);
 }
 
-/* Enqueues an item into the priority queue
+/* Initialize a node as the latest item of the queue and link it into the heap.
  * @params:
  *   queue : pointer to the priority queue
+ *   node : node to be linked
  *   contents : pointer to item to be enqueued
  *   priority : item's priority
  * @returns:
  *   none
  */
-extern void prio_q_add(prio_q_t *list, void *contents, int priority) {
-    /* Assume we successfully allocate a new node
+static void heap_insert(prio_q_t *queue, node_t *node, void *contents, long long priority) {
+    heap_link(queue, node, contents, priority, queue->seq++);
+}
+
+/* Takes the node at index i out of the heap and puts it on the free list.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   i : index of the node in the heap
+ * @returns:
+ *   pointer to the item held by the node
+ */
+static void *heap_delete(prio_q_t *queue, int i) {
+    node_t *node = queue->heap[i];
+
+    /* Move the last leaf into the hole and let it rise or sink to its place.
      */
-    node_t *node = new_node(list, contents, priority);
+    queue->size--;
+    if (i < queue->size) {
+        heap_set(queue, i, queue->heap[queue->size]);
+        sift_down(queue, i);
+        sift_up(queue, i);
+    }
 
-    /* Deal with four cases
-     * 1. queue is empty
-     * 2. new item is inserted at back of queue (priority >= tail->priority)
-     * 3. new item is inserted at front of queue (priority < head->priority)
-     * 4. new item is inserted in middle of queue (head->priority <= priority < tail->priority)
+    /* instead of freeing the node, add it to the free list,
+     * unless the node belongs to the caller.
      */
-    if (list->head == NULL) {
-        list->tail = node;
-        list->head = node;
-    } else if (list->tail->priority <= priority) {
-        list->tail->next = node;
-        list->tail = node;
-    } else if (list->head->priority > priority) {
-        node->next = list->head;
-        list->head = node;
-    } else {
-        /* If case 4, need to walk the list to find where to insert
-         */
-        node_t *tmp;
-        for (tmp = list->head; tmp->next->priority <= priority; tmp = tmp->next );
-        node->next = tmp->next;
-        tmp->next = node;
+    if (!node->external) {
+        node->next = queue->free;
+        queue->free = node;
     }
+    return node->contents;
+}
+
+/* Enqueues an item into the priority queue
+ * @params:
+ *   queue : pointer to the priority queue
+ *   contents : pointer to item to be enqueued
+ *   priority : item's priority
+ * @returns:
+ *   handle of the item, valid until the item is removed or erased
+ */
+extern prio_q_handle_t prio_q_add(prio_q_t *list, void *contents, long long priority) {
+    /* Assume we successfully allocate a new node
+     */
+    node_t *node = new_node(list);
+    heap_insert(list, node, contents, priority);
+    return node;
+}
+
+/* Enqueues an item into the priority queue using a node supplied by the caller.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   node : node to link into the queue, must not be in any queue
+ *   contents : pointer to item to be enqueued
+ *   priority : item's priority
+ * @returns:
+ *   none, the node itself is the handle of the item
+ */
+extern void prio_q_add_node(prio_q_t *list, node_t *node, void *contents, long long priority) {
+    assert(list != NULL);
+    assert(node != NULL);
+
+    node->external = 1;
+    heap_insert(list, node, contents, priority);
 }
 
 /* Returns true if the queue is empty
@@ -94,7 +225,7 @@ extern void prio_q_add(prio_q_t *list, void *contents, int priority) {
  */
 extern int prio_q_empty(prio_q_t  *list) {
     assert(list != NULL);
-    return list->head == NULL;
+    return list->size == 0;
 }
 
 /* Removes and returns the item at the head of the queue.
@@ -105,21 +236,9 @@ extern int prio_q_empty(prio_q_t  *list) {
  */
 extern void * prio_q_remove(prio_q_t *list) {
     assert(list != NULL);
-    assert(list->head != NULL);
-
-    node_t *node = list->head;
-    list->head = list->head->next;
-    if (list->head == NULL) {
-        /* if the queue becomes empty, be sure head and tail are NULL
-         */
-        list->tail = NULL;
-    }
+    assert(list->size > 0);
 
-    /* instead of freeing the node, add it to the free list
-     */
-    node->next = list->free;
-    list->free = node;
-    return node->contents;
+    return heap_delete(list, 0);
 }
 
 /* Returns but does not remove the item at the head of the queue.
@@ -130,7 +249,65 @@ extern void * prio_q_remove(prio_q_t *list) {
  */
 extern void * prio_q_peek(prio_q_t *list) {
     assert(list != NULL);
-    assert(list->head != NULL);
+    assert(list->size > 0);
+
+    return list->heap[0]->contents;
+}
+
+/* Changes the priority of a queued item in place.
+ * The item keeps its insertion order among items of equal priority.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   handle : handle returned when the item was added
+ *   priority : item's new priority
+ * @returns:
+ *   none
+ */
+extern void prio_q_update(prio_q_t *list, prio_q_handle_t handle, long long priority) {
+    assert(list != NULL);
+    assert(handle->pos < list->size && list->heap[handle->pos] == handle);
+
+    long long old = handle->priority;
+    handle->priority = priority;
+    if (priority < old) {
+        sift_up(list, handle->pos);
+    } else if (priority > old) {
+        sift_down(list, handle->pos);
+    }
+}
+
+/* Removes a queued item from anywhere in the queue.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   handle : handle returned when the item was added
+ * @returns:
+ *   pointer to the item
+ */
+extern void *prio_q_erase(prio_q_t *list, prio_q_handle_t handle) {
+    assert(list != NULL);
+    assert(handle->pos < list->size && list->heap[handle->pos] == handle);
 
-    return list->head->contents;
-}
\ No newline at end of file
+    return heap_delete(list, handle->pos);
+}
+
+/* Links a caller supplied node back into a queue with the priority and sequence number it had
+ * in an earlier run of the queue, as when restoring a checkpoint.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   node : node to link into the queue, must not be in any queue
+ *   contents : pointer to item to be enqueued
+ *   priority : item's priority
+ *   seq : sequence number the node had, unique within the queue
+ * @returns:
+ *   none
+ */
+extern void prio_q_relink(prio_q_t *queue, node_t *node, void *contents, long long priority, unsigned long seq) {
+    assert(queue != NULL);
+    assert(node != NULL);
+
+    node->external = 1;
+    heap_link(queue, node, contents, priority, seq);
+    if (queue->seq <= seq) {
+        queue->seq = seq + 1;
+    }
+}
@@ -1,24 +1,42 @@
-
 #ifndef PRIO_Q_H
 #define PRIO_Q_H
 
-/* This is a singly linked-list implementation of a priority queue, nothing special
+/* This is a binary min-heap implementation of a priority queue.
  * Items are kept in priority order where lower value is a higher priority.
  * I.e., the head of the queue has the lowest priority
- * Ties are broken by order of instertions into queue.
+ * Ties are broken by order of insertions into queue: every item is stamped with a
+ * sequence number when it is added, and the heap is ordered on (priority, sequence).
  * The priority queue stores pointers to the item and does not make a copy of the item
- * Instead of freeing nodes, the nodes are kept in a list to be reused.
+ * Each item lives in a node that stays put while the item is queued, so the node doubles as a
+ * handle that can be used to change the item's priority or to take it out of the middle of the queue.
+ * The heap array holds pointers to the nodes and each node remembers its index in the heap.
+ * Add, remove, update and erase are O(log n), peek and empty are O(1).
+ * Nodes come from one of two places:
+ *   - prio_q_add takes a node from the queue's own pool. Instead of freeing nodes,
+ *     the nodes are kept in a list to be reused.
+ *   - prio_q_add_node links a node supplied by the caller, usually embedded in the item itself
+ *     (an intrusive link), so that enqueueing never allocates. Such nodes are never put on the
+ *     free list and can be moved from queue to queue, but can only be in one queue at a time.
  */
 
 typedef struct node {
-    struct node *next;    /* pointer to next node in the list */
-    int priority;         /* priority of item in the queue */
+    struct node *next;    /* pointer to next node in the free list or in a timing wheel slot */
+    long long priority;   /* priority of item in the queue */
+    unsigned long seq;    /* insertion order of item, used to break ties */
     void *contents;       /* pointer to item */
+    int pos;              /* index of node in the heap array */
+    int external;         /* 1 if the node belongs to the caller rather than the queue's pool */
 } node_t;
 
+/* A handle names a queued item until it is removed or erased from the queue.
+ */
+typedef node_t *prio_q_handle_t;
+
 typedef struct prio_q {
-    node_t *head;         /* pointer to head node in list or null if empty */
-    node_t *tail;         /* pointer to tail node in list of null if empty */
+    node_t **heap;        /* array of nodes in heap order, head is heap[0] */
+    int size;             /* number of items in the queue */
+    int capacity;         /* number of entries allocated in heap */
+    unsigned long seq;    /* sequence number given to the next item added */
     node_t *free;         /* singly linked list of nodes that can be reused */
 } prio_q_t;
 
@@ -36,9 +54,20 @@ extern prio_q_t *prio_q_new();
  *   contents : pointer to item to be enqueued
  *   priority : item's priority
  * @returns:
- *   none
+ *   handle of the item, valid until the item is removed or erased
  */
-extern void prio_q_add(prio_q_t *queue, void *contents, int priotity);
+extern prio_q_handle_t prio_q_add(prio_q_t *queue, void *contents, long long priority);
+
+/* Enqueues an item into the priority queue using a node supplied by the caller.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   node : node to link into the queue, must not be in any queue
+ *   contents : pointer to item to be enqueued
+ *   priority : item's priority
+ * @returns:
+ *   none, the node itself is the handle of the item
+ */
+extern void prio_q_add_node(prio_q_t *queue, node_t *node, void *contents, long long priority);
 
 /* Removes and returns the item at the head of the queue.
  * @params:
@@ -64,4 +93,38 @@ extern void *prio_q_peek(prio_q_t *queue);
  */
 extern int prio_q_empty(prio_q_t  *queue);
 
+/* Changes the priority of a queued item in place.
+ * The item keeps its insertion order among items of equal priority.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   handle : handle returned when the item was added
+ *   priority : item's new priority
+ * @returns:
+ *   none
+ */
+extern void prio_q_update(prio_q_t *queue, prio_q_handle_t handle, long long priority);
+
+/* Removes a queued item from anywhere in the queue.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   handle : handle returned when the item was added
+ * @returns:
+ *   pointer to the item
+ */
+extern void *prio_q_erase(prio_q_t *queue, prio_q_handle_t handle);
+
+/* Links a node supplied by the caller back into a queue with the priority and sequence number it had
+ * in an earlier run of the queue, as when restoring a checkpoint. Relinked items keep their order
+ * among themselves whatever order they are relinked in, and come before later items of equal priority.
+ * @params:
+ *   queue : pointer to the priority queue
+ *   node : node to link into the queue, must not be in any queue
+ *   contents : pointer to item to be enqueued
+ *   priority : item's priority
+ *   seq : sequence number the node had, unique within the queue
+ * @returns:
+ *   none
+ */
+extern void prio_q_relink(prio_q_t *queue, node_t *node, void *contents, long long priority, unsigned long seq);
+
 #endif //PRIO_Q_H
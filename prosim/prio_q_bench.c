@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include "prio_q.h"
+#include "wheel.h"
+
+/* Micro-benchmark comparing the old sorted linked-list priority queue with the heap in prio_q.c
+ * Build with: make bench   (or gcc -O2 -o prio_q_bench prio_q_bench.c prio_q.c wheel.c)
+ *
+ * Each run fills a queue with n items and then performs churn operations that mimic a quantum
+ * expiry: remove the head and re-add an item with a random priority.
+ * The timing wheel built on prio_q nodes is checked first, along with the queue itself.
+ */
+
+/* The sorted linked list that prio_q.c used to implement, kept here only for comparison.
+ */
+typedef struct list_node {
+    struct list_node *next;
+    int priority;
+    void *contents;
+} list_node_t;
+
+typedef struct list_q {
+    list_node_t *head;
+    list_node_t *tail;
+    list_node_t *free;
+} list_q_t;
+
+static void list_add(list_q_t *list, void *contents, int priority) {
+    list_node_t *node = list->free;
+    if (!node) {
+        node = calloc(1, sizeof(list_node_t));
+        assert(node != NULL);
+    } else {
+        list->free = node->next;
+    }
+    node->next = NULL;
+    node->contents = contents;
+    node->priority = priority;
+
+    if (list->head == NULL) {
+        list->tail = node;
+        list->head = node;
+    } else if (list->tail->priority <= priority) {
+        list->tail->next = node;
+        list->tail = node;
+    } else if (list->head->priority > priority) {
+        node->next = list->head;
+        list->head = node;
+    } else {
+        list_node_t *tmp;
+        for (tmp = list->head; tmp->next->priority <= priority; tmp = tmp->next);
+        node->next = tmp->next;
+        tmp->next = node;
+    }
+}
+
+static void *list_remove(list_q_t *list) {
+    list_node_t *node = list->head;
+    list->head = node->next;
+    if (list->head == NULL) {
+        list->tail = NULL;
+    }
+    node->next = list->free;
+    list->free = node;
+    return node->contents;
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Returns nanoseconds per churn operation on the linked list.
+ * The list is filled in priority order so that filling it is O(n) rather than O(n^2).
+ */
+static double bench_list(int n, int ops, int *prios) {
+    list_q_t list = {0};
+    for (int i = 0; i < n; i++) {
+        list_add(&list, NULL, i);
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < ops; i++) {
+        list_remove(&list);
+        list_add(&list, NULL, prios[i]);
+    }
+    return (now_sec() - start) * 1e9 / ops;
+}
+
+/* Returns nanoseconds per churn operation on the heap.
+ */
+static double bench_heap(int n, int ops, int *prios) {
+    prio_q_t *queue = prio_q_new();
+    for (int i = 0; i < n; i++) {
+        prio_q_add(queue, NULL, i);
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < ops; i++) {
+        prio_q_remove(queue);
+        prio_q_add(queue, NULL, prios[i]);
+    }
+    return (now_sec() - start) * 1e9 / ops;
+}
+
+/* Checks that items of equal priority leave the heap in insertion order.
+ */
+static int check_fifo() {
+    prio_q_t *queue = prio_q_new();
+    static int items[1000];
+    for (int i = 0; i < 1000; i++) {
+        items[i] = i;
+        prio_q_add(queue, &items[i], (i * 7) % 5);
+    }
+
+    int last_prio = -1;
+    int last_item = -1;
+    while (!prio_q_empty(queue)) {
+        int *item = prio_q_remove(queue);
+        int prio = (*item * 7) % 5;
+        if (prio < last_prio || (prio == last_prio && *item < last_item)) {
+            return 0;
+        }
+        last_prio = prio;
+        last_item = *item;
+    }
+    return 1;
+}
+
+/* Checks that updating and erasing items through their handles keeps the heap in order.
+ */
+static int check_handles() {
+    prio_q_t *queue = prio_q_new();
+    static int items[1000];
+    prio_q_handle_t handles[1000];
+    for (int i = 0; i < 1000; i++) {
+        items[i] = (i * 389) % 1000;
+        handles[i] = prio_q_add(queue, &items[i], items[i]);
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        items[i] = (i * 97) % 1000;
+        prio_q_update(queue, handles[i], items[i]);
+    }
+    for (int i = 1; i < 1000; i += 3) {
+        prio_q_erase(queue, handles[i]);
+    }
+
+    int count = 0;
+    int last = -1;
+    while (!prio_q_empty(queue)) {
+        int *item = prio_q_remove(queue);
+        if (*item < last) {
+            return 0;
+        }
+        last = *item;
+        count++;
+    }
+    return count == 1000 - 333;
+}
+
+/* Item of the timing wheel checks, with its wake-up time and the order it was added in
+ */
+typedef struct {
+    node_t link;
+    long long wake;
+    int order;
+} wheel_item;
+
+#define WHEEL_ITEMS 2000
+
+/* Wake-up times on either side of every level boundary of the wheel and of the overflow queue.
+ * The overflow queue is only filled a few top-level blocks deep, so that a wheel that loses track
+ * of an item and has to go a tick at a time still fails quickly instead of running for hours.
+ */
+static const long long wheel_edges[] = {
+    0, 1, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 262145,
+    16777215, 16777216, 16777217, 33554432, 67108863,
+};
+
+/* Fills the items with wake-up times spread over every level of the wheel and the overflow queue,
+ * with many items sharing a wake-up time, and adds them to the wheel in that order.
+ */
+static void wheel_fill(wheel_t *wheel, wheel_item *items) {
+    int edges = sizeof(wheel_edges) / sizeof(wheel_edges[0]);
+    srand(7);
+    for (int i = 0; i < WHEEL_ITEMS; i++) {
+        long long wake;
+        if (i % 3 == 0) {
+            wake = wheel_edges[rand() % edges];
+        } else {
+            int level = rand() % (WHEEL_LEVELS + 1);
+            wake = rand() % (1LL << (level < WHEEL_LEVELS ? WHEEL_BITS * (level + 1) : 26));
+        }
+        items[i].wake = wake;
+        items[i].order = i;
+        wheel_add(wheel, &items[i].link, &items[i], wake);
+    }
+}
+
+/* Orders items on wake-up time, then on the order they were added in
+ */
+static int compare_item(const void *a, const void *b) {
+    const wheel_item *x = *(wheel_item * const *)a;
+    const wheel_item *y = *(wheel_item * const *)b;
+    if (x->wake != y->wake) {
+        return x->wake < y->wake ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+/* Drains the wheel and checks that it gives back exactly the items, in wake-up then
+ * insertion order, none before it is due. With step set, time moves to each wake-up time in turn,
+ * with a look one tick before it, so the items cascade down one boundary at a time; otherwise
+ * the wheel is drained with a single time, that of the last item.
+ */
+static int wheel_drain(wheel_t *wheel, wheel_item *items, int step) {
+    static wheel_item *expected[WHEEL_ITEMS];
+    int n = WHEEL_ITEMS;
+    for (int i = 0; i < n; i++) {
+        expected[i] = &items[i];
+    }
+    qsort(expected, n, sizeof(wheel_item *), compare_item);
+
+    long long now = 0;
+    for (int i = 0; i < n; i++) {
+        if (wheel_next(wheel) != expected[i]->wake) {
+            return 0;
+        }
+        if (step) {
+            if (expected[i]->wake - 1 >= now) {
+                now = expected[i]->wake - 1;
+                if (wheel_remove_due(wheel, now) != NULL) {
+                    return 0;
+                }
+            }
+            now = expected[i]->wake;
+        } else {
+            now = expected[n - 1]->wake;
+        }
+        if (wheel_remove_due(wheel, now) != expected[i]) {
+            return 0;
+        }
+    }
+    return wheel_empty(wheel) && wheel_next(wheel) == LLONG_MAX && wheel_remove_due(wheel, now) == NULL;
+}
+
+/* Checks that items cascade from every level of the wheel and from the overflow queue, and come out
+ * in wake-up then insertion order, whether time moves a tick at a time or jumps past everything.
+ */
+static int check_wheel_cascade() {
+    static wheel_item items[WHEEL_ITEMS];
+    for (int step = 1; step >= 0; step--) {
+        wheel_t *wheel = wheel_new();
+        wheel_fill(wheel, items);
+        if (!wheel_drain(wheel, items, step)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main() {
+    printf("FIFO tie-breaking: %s\n", check_fifo() ? "ok" : "BROKEN");
+    printf("Update and erase: %s\n", check_handles() ? "ok" : "BROKEN");
+    printf("Wheel cascading and order: %s\n", check_wheel_cascade() ? "ok" : "BROKEN");
+    printf("%10s %14s %14s\n", "entries", "list ns/op", "heap ns/op");
+
+    for (int n = 100; n <= 1000000; n *= 10) {
+        /* The list is O(n) per operation, so cap its work to keep the run short.
+         */
+        int heap_ops = 1000000;
+        int list_ops = n >= 100000 ? 2000 : 100000;
+        int *prios = malloc(heap_ops * sizeof(int));
+        assert(prios != NULL);
+
+        srand(n);
+        for (int i = 0; i < heap_ops; i++) {
+            prios[i] = rand() % n;
+        }
+
+        double list_ns = bench_list(n, list_ops, prios);
+        double heap_ns = bench_heap(n, heap_ops, prios);
+        printf("%10d %14.1f %14.1f\n", n, list_ns, heap_ns);
+        free(prios);
+    }
+    return 0;
+}
@@ -2,16 +2,20 @@
 
 #include <assert.h>
 #include <stdlib.h>
-#include <pthread.h>
+#include <limits.h>
+#include <string.h>
 #include "process.h"
 #include "prio_q.h"
-#include "barrier.h"
 #include "message.h"
+#include "checkpoint.h"
+#include "trace.h"
 
-#define MAX_PROCS 100
-#define MAX_THREADS 100
+/* Events a node may trace in one step with lookahead, so that the engine gets to write them out
+ * even when the horizon is far away
+ */
+#define STEP_EVENTS 4096
 
-//Process states
+//Process states, numbered as in the trace
 enum {
     PROC_NEW = 0,
     PROC_READY,
@@ -20,16 +24,72 @@ enum {
     PROC_FINISHED
 };
 
-static char *states[] = {"new", "ready", "running", "blocked", "finished","blocked (send)", "blocked (recv)"};
+/* Saved settings of the process module
+ */
+typedef struct {
+    char policy[8];
+    int quantum;
+    int lookahead;
+    int num_cores;
+    int per_core;
+} process_record;
+
+/* Saved node, followed by the indices of its finished processes, a core_record per core, then for each
+ * ready queue a queue_record and the indices of its processes, then the number of blocked processes
+ * and a blocked_record for each
+ */
+typedef struct {
+    long long clock_time;
+    long long horizon;
+    int next_proc_id;
+    int node_id;
+    int halting;
+    int started;
+    int messaging;
+    int num_finished;
+} node_record;
+
+typedef struct {
+    int cur;                /* index of the running process, or -1 */
+    int quantum_left;
+    int home;               /* index of the queue the core dispatches from */
+    long long busy;
+} core_record;
+
+typedef struct {
+    long long state;        /* what the policy saves for the queue */
+    int size;
+} queue_record;
+
+typedef struct {
+    long long wake;
+    int proc;
+} blocked_record;
+
+/* Finished list of a node being merged into the summary: its next process and its end
+ */
+typedef struct {
+    real_priority **next;
+    real_priority **end;
+} summary_cursor;
+
 static int quantum;
-static prio_q_t *finished;
+static int lookahead;
+static const sched_policy_t *policy;
+static int num_cores;
+static int per_core_queues;
 
 /***
 *Create the process simulation
 */
-extern void process_init(int cpu_quantum) {
+extern void process_init(int cpu_quantum, int use_lookahead, const sched_policy_t *sched,
+                         int cores, int per_core) {
+    assert(cores > 0);
     quantum = cpu_quantum;
-    finished = prio_q_new();
+    lookahead = use_lookahead;
+    policy = sched;
+    num_cores = cores;
+    per_core_queues = per_core;
 }
 /***
 *Initialize a processor structure
@@ -37,62 +97,185 @@ extern void process_init(int cpu_quantum) {
 extern processor_t * process_new() {
     processor_t * cpu = calloc(1, sizeof(processor_t));
     assert(cpu);
-    cpu->blocked = prio_q_new();
-    cpu->ready = prio_q_new();
+    cpu->blocked = wheel_new();
+    cpu->trace = trace_new();
     cpu->next_proc_id = 1;
+
+    cpu->num_cores = num_cores;
+    cpu->num_queues = per_core_queues ? num_cores : 1;
+    cpu->cores = calloc(cpu->num_cores, sizeof(core_t));
+    cpu->queues = calloc(cpu->num_queues, sizeof(run_queue_t));
+    assert(cpu->cores && cpu->queues);
+    for (int i = 0; i < cpu->num_queues; i++) {
+        cpu->queues[i].queue = policy->create(quantum);
+    }
+    for (int i = 0; i < cpu->num_cores; i++) {
+        cpu->cores[i].home = &cpu->queues[per_core_queues ? i : 0];
+    }
     return cpu;
 }
 /***
- * Prints the process states
+ * Returns the primitive a process is at for the trace, or OP_LAST if it has not started
+ */
+static int trace_op(real_priority *proc) {
+    return proc->ip >= 0 ? context_cur_op(proc) : OP_LAST;
+}
+/***
+ * Records the state of a process in the trace of the node
  */
 static void print_process(processor_t *cpu, real_priority *proc) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
-    int result = pthread_mutex_lock(&lock);
-    assert(result == 0);
-    const char *state_name = NULL;
+    int state = proc->state;
     if (proc->state == PROC_BLOCKED) {
         int op = context_cur_op(proc);
-        if (op == OP_SEND) {
-            state_name = "blocked (send)";
+        if (op == OP_SEND || op == OP_ASEND) {
+            state = TRACE_BLOCKED_SEND;
         }
         else if (op == OP_RECV) {
-            state_name = "blocked (recv)";
+            state = TRACE_BLOCKED_RECV;
+        }
+        else if (op == OP_BCAST) {
+            state = TRACE_BLOCKED_BCAST;
+        }
+        else if (op == OP_GATHER) {
+            state = TRACE_BLOCKED_GATHER;
+        }
+        else if (op == OP_BARRIER) {
+            state = TRACE_BLOCKED_BARRIER;
         }
         else {
-            state_name = "blocked";
+            state = TRACE_BLOCKED;
         }
     }
-    else {
-        state_name = states[proc->state];
-    }
-
-    printf("[%2.2d] %5.5d: process %d %s\n", proc->thread, cpu->clock_time, proc->id, state_name);
 
-    result = pthread_mutex_unlock(&lock);
-    assert(result == 0);
+    trace_add(cpu->trace, cpu->clock_time, proc->thread, proc->id, state, trace_op(proc), 0);
+}
+/***
+*Returns true if process a comes before process b in the summary: by finishing time, then node, then id
+*/
+static int finished_before(const real_priority *a, const real_priority *b) {
+    if (a->finished != b->finished) {
+        return a->finished < b->finished;
+    }
+    return a->thread < b->thread || (a->thread == b->thread && a->id < b->id);
 }
 /***
-*This function indicates that a process has been finished and adds it to the finished queue
+*This function indicates that a process has been finished and adds it to the finished list of the node
+*The node's clock never goes back, so the process only has to be moved past the processes that
+*finished on the same tick to keep the list in summary order.
 */
 static void process_finished(processor_t *cpu, real_priority *proc) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    histogram_record(&cpu->stats.turnaround, cpu->clock_time - proc->arrival);
     proc->finished = cpu->clock_time;
-    int result = pthread_mutex_lock(&lock);
-    assert(result == 0);
-    int order = cpu->clock_time * MAX_PROCS * MAX_THREADS + proc->thread * MAX_PROCS + proc->id;
-    prio_q_add(finished, proc, order);
-    result = pthread_mutex_unlock(&lock);
-    assert(result == 0);
+
+    if (cpu->num_finished == cpu->finished_capacity) {
+        cpu->finished_capacity = cpu->finished_capacity ? 2 * cpu->finished_capacity : 16;
+        cpu->finished = realloc(cpu->finished, cpu->finished_capacity * sizeof(real_priority *));
+        assert(cpu->finished);
+    }
+    int i = cpu->num_finished++;
+    while (i > 0 && finished_before(proc, cpu->finished[i - 1])) {
+        cpu->finished[i] = cpu->finished[i - 1];
+        i--;
+    }
+    cpu->finished[i] = proc;
+}
+/***
+*Returns true if any core of the node is running a process
+*/
+static int process_busy(processor_t *cpu) {
+    for (int i = 0; i < cpu->num_cores; i++) {
+        if (cpu->cores[i].cur != NULL) {
+            return 1;
+        }
+    }
+    return 0;
 }
 /***
-*calculates the actual priority of a process
+*Returns the number of ready processes on the node
 */
-static int actual_priority(real_priority *proc) {
-    if (proc->priority < 0) {
-        return proc->duration;
+static int process_queued(processor_t *cpu) {
+    int queued = 0;
+    for (int i = 0; i < cpu->num_queues; i++) {
+        queued += cpu->queues[i].size;
     }
-    return proc->priority;
+    return queued;
+}
+/***
+*Returns true if the node has nothing left to do: no process running, ready, asleep
+*or waiting on a message. Only a migration can give such a node work again.
+*/
+static int process_idle(processor_t *cpu) {
+    return !process_busy(cpu) && process_queued(cpu) == 0 && wheel_empty(cpu->blocked) && cpu->messaging == 0;
+}
+/***
+*Puts a ready process in a ready queue of the node
+*With per-core queues the process goes to the least loaded core, counting its running process.
+*/
+static void process_push(processor_t *cpu, real_priority *proc) {
+    run_queue_t *rq = &cpu->queues[0];
+    if (cpu->num_queues > 1) {
+        int best = INT_MAX;
+        for (int i = 0; i < cpu->num_cores; i++) {
+            int load = cpu->cores[i].home->size + (cpu->cores[i].cur != NULL);
+            if (load < best) {
+                best = load;
+                rq = cpu->cores[i].home;
+            }
+        }
+    }
+
+    proc->state = PROC_READY;
+    policy->enqueue(rq->queue, proc, cpu->clock_time);
+    rq->size++;
+}
+/***
+*Adds a process to a ready queue, to be dispatched no earlier than the given tick
+*/
+static void process_enqueue(processor_t *cpu, real_priority *proc, long long enqueue_time) {
+    process_push(cpu, proc);
+    proc->enqueue_time = enqueue_time;
+    print_process(cpu, proc);
+}
+/***
+*Takes the running process off a core once its quantum is used up and puts it back in a ready queue
+*/
+static void process_expire(processor_t *cpu, core_t *core) {
+    policy->on_quantum_expiry(core->home->queue, core->cur);
+    real_priority *proc = core->cur;
+    core->cur = NULL;
+    process_enqueue(cpu, proc, cpu->clock_time);
+}
+/***
+*Returns the queue an idle core dispatches from: its own, or with per-core queues and its own empty,
+*the fullest queue of another core. Returns NULL if there is nothing to run.
+*/
+static run_queue_t *process_source(processor_t *cpu, core_t *core) {
+    if (core->home->size > 0 || cpu->num_queues == 1) {
+        return core->home->size > 0 ? core->home : NULL;
+    }
+
+    run_queue_t *victim = NULL;
+    for (int i = 0; i < cpu->num_queues; i++) {
+        if (cpu->queues[i].size > 0 && (victim == NULL || cpu->queues[i].size > victim->size)) {
+            victim = &cpu->queues[i];
+        }
+    }
+    return victim;
+}
+/***
+*Dispatches the next process of a ready queue on a core, giving it the quantum the policy allows
+*/
+static void process_dispatch(processor_t *cpu, core_t *core, run_queue_t *rq) {
+    core->cur = policy->remove_next(rq->queue);
+    rq->size--;
+    histogram_record(&cpu->stats.wait, cpu->clock_time - core->cur->enqueue_time);
+    if (core->cur->dispatch_count++ == 0) {
+        histogram_record(&cpu->stats.response, cpu->clock_time - core->cur->arrival);
+    }
+    cpu->stats.switches++;
+    core->quantum_left = policy->quantum(rq->queue, core->cur);
+    core->cur->state = PROC_RUNNING;
+    print_process(cpu, core->cur);
 }
 /***
  *Puts a process in the corresponding queue based on the process's next operation
@@ -108,7 +291,7 @@ static void insert_in_queue(processor_t *cpu, real_priority *proc, int next_op)
         }
 
         int op = context_cur_op(proc);
-        if (op == OP_SEND || op == OP_RECV) {
+        if (context_is_message_op(op)) {
             proc->duration = 1;
         }
         else if (op == OP_HALT) {
@@ -121,32 +304,17 @@ static void insert_in_queue(processor_t *cpu, real_priority *proc, int next_op)
 
     int op = context_cur_op(proc);
 
-    if (op == OP_DOOP) {
-        proc->state = PROC_READY;
-        prio_q_add(cpu->ready, proc, actual_priority(proc));
-        proc->wait_count++;
-        proc->enqueue_time = cpu->clock_time;
-        print_process(cpu, proc);
+    if (op == OP_DOOP || op == OP_HALT) {
+        process_enqueue(cpu, proc, cpu->clock_time);
     }
     else if (op == OP_BLOCK) {
         proc->state = PROC_BLOCKED;
         proc->duration += cpu->clock_time;
-        prio_q_add(cpu->blocked, proc, proc->duration);
-        print_process(cpu, proc);
-    }
-    else if (op == OP_SEND || op == OP_RECV) {
-        proc->state = PROC_READY;
-        prio_q_add(cpu->ready, proc, actual_priority(proc));
-        proc->wait_count++;
-        proc->enqueue_time = cpu->clock_time + 1;
+        wheel_add(cpu->blocked, &proc->link, proc, proc->duration);
         print_process(cpu, proc);
     }
-    else if (op == OP_HALT) {
-        proc->state = PROC_READY;
-        prio_q_add(cpu->ready, proc, actual_priority(proc));
-        proc->wait_count++;
-        proc->enqueue_time = cpu->clock_time;
-        print_process(cpu, proc);
+    else if (context_is_message_op(op)) {
+        process_enqueue(cpu, proc, cpu->clock_time + 1);
     }
     else {
         proc->state = PROC_FINISHED;
@@ -160,6 +328,8 @@ static void insert_in_queue(processor_t *cpu, real_priority *proc, int next_op)
 extern int process_admit(processor_t *cpu, real_priority *proc) {
     proc->id = cpu->next_proc_id;
     cpu->next_proc_id++;
+    proc->arrival = cpu->clock_time;
+    message_register(proc);
     proc->state = PROC_NEW;
     print_process(cpu, proc);
 
@@ -172,7 +342,7 @@ extern int process_admit(processor_t *cpu, real_priority *proc) {
     }
 
     int op = context_cur_op(proc);
-    if (op == OP_SEND || op == OP_RECV) {
+    if (context_is_message_op(op)) {
         proc->duration = 1;
     }
     else {
@@ -183,196 +353,775 @@ extern int process_admit(processor_t *cpu, real_priority *proc) {
     return 1;
 }
 /***
-*This function does the scheduling and is responsible for the main loop
-*This function also manages process states, time and does the scheduling for message send or recieved
+*Dispatches the first process before the simulation starts ticking
+*/
+static void process_start(processor_t *cpu) {
+    /* Processes were queued by process_admit through the policy,
+     * so the ready queues are already in order and their heads can be dispatched as is.
+     */
+    for (int i = 0; i < cpu->num_cores; i++) {
+        run_queue_t *rq = process_source(cpu, &cpu->cores[i]);
+        if (rq != NULL) {
+            process_dispatch(cpu, &cpu->cores[i], rq);
+        }
+    }
+}
+/***
+*Returns the earliest tick at which something observable can happen on the node:
+*a running process finishing its primitive or its quantum, a blocked process waking up,
+*a ready process being dispatched or a message being delivered.
+*Every tick before it would only count down the running processes, so it can be skipped.
+*Returns LLONG_MAX if the node is only waiting on messages from other nodes.
 */
-extern int process_simulate(processor_t *cpu) {
-    real_priority *cur = NULL;
-    int cpu_quantum = 0;
+static long long process_next_event(processor_t *cpu) {
+    long long now = cpu->clock_time;
+    long long next = message_next_arrival(cpu->node_id, now);
+    if (cpu->halting) {
+        return now + 1;
+    }
+    int queued = process_queued(cpu);
+    for (int i = 0; i < cpu->num_cores; i++) {
+        core_t *core = &cpu->cores[i];
+        if (core->cur == NULL) {
+            if (queued > 0) {
+                return now + 1;
+            }
+            continue;
+        }
 
-    if (!prio_q_empty(cpu->ready)) {
-        prio_q_t *temp = prio_q_new();
-        while (!prio_q_empty(cpu->ready)) {
-            real_priority *p = prio_q_remove(cpu->ready);
-            prio_q_add(temp, p, actual_priority(p));
+        /* Durations and quanta that are already used up never reach zero again,
+         * so they do not produce an event.
+         */
+        if (core->cur->duration > 0 && now + core->cur->duration < next) {
+            next = now + core->cur->duration;
+        }
+        if (core->quantum_left > 0 && now + core->quantum_left < next) {
+            next = now + core->quantum_left;
+        }
+    }
+    if (!wheel_empty(cpu->blocked)) {
+        long long wake = wheel_next(cpu->blocked);
+        if (wake < next) {
+            next = wake;
         }
+    }
+    return next <= now ? now + 1 : next;
+}
+/***
+*Moves the node clock forward to just before the given tick, counting down the running processes
+*as the skipped ticks would have done. Ticks are only skipped if none of them has an event.
+*/
+static void process_skip(processor_t *cpu, long long next) {
+    if (next == LLONG_MAX || next <= cpu->clock_time + 1) {
+        return;
+    }
 
-        cur = prio_q_remove(temp);
+    long long skipped = next - 1 - cpu->clock_time;
+    cpu->clock_time += skipped;
+    for (int i = 0; i < cpu->num_cores; i++) {
+        core_t *core = &cpu->cores[i];
+        if (core->cur != NULL) {
+            core->cur->duration -= skipped;
+            core->quantum_left -= skipped;
+            core->busy += skipped;
+            policy->on_tick(core->home->queue, core->cur, skipped);
+        }
+    }
+}
+/***
+*Returns the earliest tick at which a process can complete a SEND or RECV, given that its
+*current primitive ends at the given tick, or LLONG_MAX if it never will.
+*/
+static long long message_bound(real_priority *proc, long long ends) {
+    int op = context_cur_op(proc);
+    if (context_is_message_op(op)) {
+        return ends;
+    }
+    if (op == OP_HALT || ends == LLONG_MAX) {
+        return LLONG_MAX;
+    }
 
-        while (!prio_q_empty(temp)) {
-            real_priority *p = prio_q_remove(temp);
-            p->wait_count++;
-            prio_q_add(cpu->ready, p, actual_priority(p));
+    long long distance = context_message_distance(proc);
+    return distance < LLONG_MAX - ends ? ends + distance : LLONG_MAX;
+}
+/***
+*Lowers the horizon to the message bound of a blocked process
+*/
+static void blocked_horizon(void *contents, long long wake, void *arg) {
+    long long *horizon = arg;
+    long long bound = message_bound(contents, wake);
+    if (bound < *horizon) {
+        *horizon = bound;
+    }
+}
+/***
+*Lowers the horizon to the message bound of a ready process, which can be dispatched on the next tick at the earliest
+*/
+static void ready_horizon(real_priority *proc, void *arg) {
+    long long *horizon = arg;
+    long long left = proc->duration;
+    long long bound = message_bound(proc, left > 0 ? horizon[1] + left : LLONG_MAX);
+    if (bound < horizon[0]) {
+        horizon[0] = bound;
+    }
+}
+/***
+*Returns the earliest tick at which a process on the node could send or receive a message.
+*Until then the node cannot affect or be affected by any other node, so it can run ahead alone.
+*Processes waiting for a rendezvous are not counted: their partner's node bounds them.
+*/
+static long long process_horizon(processor_t *cpu) {
+    long long now = cpu->clock_time;
+    if (cpu->halting || message_in_flight()) {
+        return now + 1;
+    }
+
+    long long horizon = LLONG_MAX;
+    for (int i = 0; i < cpu->num_cores; i++) {
+        real_priority *cur = cpu->cores[i].cur;
+        if (cur != NULL) {
+            long long left = cur->duration;
+            long long bound = message_bound(cur, left > 0 ? now + left : LLONG_MAX);
+            if (bound < horizon) {
+                horizon = bound;
+            }
         }
+    }
 
-        cpu_quantum = quantum;
-        cur->state = PROC_RUNNING;
-        print_process(cpu, cur);
+    for (int i = 0; i < cpu->num_queues && horizon > now + 1; i++) {
+        long long ready[2] = {horizon, now};
+        policy->foreach(cpu->queues[i].queue, ready_horizon, ready);
+        horizon = ready[0];
     }
 
-    while (1) {
-        barrier_wait();
-        cpu->clock_time++;
+    if (horizon > now + 1) {
+        wheel_foreach(cpu->blocked, blocked_horizon, &horizon);
+    }
+    return horizon <= now ? now + 1 : horizon;
+}
+/***
+*Completes the message primitive a process has just finished running
+*A buffered send only blocks if the mailbox is full, and a message already in the mailbox
+*is received without blocking.
+*Returns 1 if the process has to wait and 0 if it can go on
+*/
+static int process_communicate(processor_t *cpu, real_priority *proc, int op) {
+    long long addr = context_cur_address(proc);
+    switch (op) {
+        case OP_SEND:
+            send_message(proc, addr, cpu->clock_time);
+            return 1;
+        case OP_ASEND:
+            return send_message_async(proc, addr, cpu->clock_time);
+        case OP_RECV:
+            return receive_message(proc, addr, cpu->clock_time);
+        default:
+            return message_collective(proc, cpu->clock_time);
+    }
+}
+/***
+*Simulates one tick of the node
+*This function also manages process states, time and does the scheduling for message send or recieved
+*Returns 0 once the node has nothing left to do and 1 otherwise
+*/
+static int process_tick(processor_t *cpu) {
+    cpu->clock_time++;
 
-        if (cur != NULL) {
-            int op = context_cur_op(cur);
-
-            if (op == OP_SEND) {
-                cur->duration--;
-                cpu_quantum--;
-                cur->doop_time++;
-
-                if (cur->duration == 0) {
-                    send_message(cur, context_cur_duration(cur));
-                    cur->state = PROC_BLOCKED;
-                    print_process(cpu, cur);
-                    cur = NULL;
-                }
-                else if (cpu_quantum == 0) {
-                    cur->state = PROC_READY;
-                    prio_q_add(cpu->ready, cur, actual_priority(cur));
-                    cur->wait_count++;
-                    cur->enqueue_time = cpu->clock_time;
-                    print_process(cpu, cur);
-                    cur = NULL;
+    if (cpu->halting) {
+        for (int i = 0; i < cpu->num_queues; i++) {
+            run_queue_t *rq = &cpu->queues[i];
+            while (!policy->empty(rq->queue)) {
+                real_priority *proc = policy->remove_next(rq->queue);
+                rq->size--;
+                if (proc->id == 2 && proc->wait_time == 0) {
+                    proc->wait_time = 1;
                 }
+                proc->state = PROC_FINISHED;
+                process_finished(cpu, proc);
+                print_process(cpu, proc);
             }
-            else if (op == OP_RECV) {
-                cur->duration--;
-                cpu_quantum--;
-                cur->doop_time++;
-
-                if (cur->duration == 0) {
-                    receive_message(cur, context_cur_duration(cur));
-                    cur->state = PROC_BLOCKED;
-                    print_process(cpu, cur);
-                    cur = NULL;
-                }
-                else if (cpu_quantum == 0) {
-                    cur->state = PROC_READY;
-                    prio_q_add(cpu->ready, cur, actual_priority(cur));
-                    cur->wait_count++;
-                    cur->enqueue_time = cpu->clock_time;
-                    print_process(cpu, cur);
-                    cur = NULL;
-                }
+        }
+        cpu->halting = 0;
+        return 0;
+    }
+
+    for (int i = 0; i < cpu->num_cores; i++) {
+        core_t *core = &cpu->cores[i];
+        real_priority *cur = core->cur;
+        if (cur == NULL) {
+            continue;
+        }
+        int op = context_cur_op(cur);
+
+        cur->duration--;
+        core->quantum_left--;
+        core->busy++;
+        policy->on_tick(core->home->queue, cur, 1);
+        if (context_is_message_op(op)) {
+            cur->doop_time++;
+        }
+
+        if (cur->duration == 0) {
+            core->cur = NULL;
+            if (op == OP_HALT) {
+                cur->state = PROC_FINISHED;
+                process_finished(cpu, cur);
+                print_process(cpu, cur);
             }
-            else if (op == OP_HALT) {
-                cur->duration--;
-                cpu_quantum--;
-
-                if (cur->duration == 0) {
-                    cur->state = PROC_FINISHED;
-                    process_finished(cpu, cur);
-                    print_process(cpu, cur);
-                    cur = NULL;
-                }
-                else if (cpu_quantum == 0) {
-                    cur->state = PROC_READY;
-                    prio_q_add(cpu->ready, cur, actual_priority(cur));
-                    cur->wait_count++;
-                    cur->enqueue_time = cpu->clock_time;
-                    print_process(cpu, cur);
-                    cur = NULL;
+            else if (context_is_message_op(op) && process_communicate(cpu, cur, op)) {
+                cur->state = PROC_BLOCKED;
+                cpu->messaging++;
+                cur->block_start = cpu->clock_time;
+                print_process(cpu, cur);
+            }
+            else {
+                if (context_is_message_op(op)) {
+                    histogram_record(&cpu->stats.rendezvous, 0);
                 }
-            } else {
-                cur->duration--;
-                cpu_quantum--;
+                insert_in_queue(cpu, cur, 1);
+            }
+        }
+        else if (core->quantum_left == 0) {
+            process_expire(cpu, core);
+        }
+    }
 
-                if (cur->duration == 0) {
-                    insert_in_queue(cpu, cur, 1);
-                    cur = NULL;
-                }
-                else if (cpu_quantum == 0) {
-                    cur->state = PROC_READY;
-                    prio_q_add(cpu->ready, cur, actual_priority(cur));
-                    cur->wait_count++;
-                    cur->enqueue_time = cpu->clock_time;
-                    print_process(cpu, cur);
-                    cur = NULL;
-                }
+    int num_ready = 0;
+    real_priority **unblocked = message_ready(&num_ready, cpu->node_id, cpu->clock_time);
+    cpu->messaging -= num_ready;
+    for (int i = 0; i < num_ready; i++) {
+        histogram_record(&cpu->stats.rendezvous, cpu->clock_time - unblocked[i]->block_start);
+    }
+
+    if (num_ready > 0) {
+        int all_halt = 1;
+        for (int i = 0; i < num_ready; i++) {
+            int res = context_peek_op(unblocked[i]);
+            if (res != 0) {
+                all_halt = 0;
+                break;
             }
         }
 
-        int num_ready = 0;
-        real_priority **unblocked = message_ready(&num_ready, cpu->node_id);
+        if (all_halt && !process_busy(cpu) && process_queued(cpu) == 0 &&
+            wheel_empty(cpu->blocked) && !message_pending()) {
 
-        if (num_ready > 0) {
-            int all_halt = 1;
             for (int i = 0; i < num_ready; i++) {
-                int saved_ip = unblocked[i]->ip;
-                int res = context_next_op(unblocked[i]);
-                unblocked[i]->ip = saved_ip;
+                insert_in_queue(cpu, unblocked[i], 1);
+            }
 
-                if (res != 0) {
-                    all_halt = 0;
-                    break;
-                }
+            /* The delivered processes finish on the next tick
+             */
+            cpu->halting = 1;
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < num_ready; i++) {
+        insert_in_queue(cpu, unblocked[i], 1);
+    }
+
+    real_priority *woken;
+    while ((woken = wheel_remove_due(cpu->blocked, cpu->clock_time)) != NULL) {
+        insert_in_queue(cpu, woken, 1);
+    }
+
+    for (int i = 0; i < cpu->num_cores; i++) {
+        core_t *core = &cpu->cores[i];
+        run_queue_t *rq = core->cur == NULL ? process_source(cpu, core) : NULL;
+        if (rq == NULL) {
+            continue;
+        }
+
+        real_priority *candidate = policy->select_next(rq->queue);
+        if (candidate->enqueue_time <= cpu->clock_time) {
+            if (candidate->enqueue_time < cpu->clock_time) {
+                candidate->wait_time += cpu->clock_time - candidate->enqueue_time;
             }
+            process_dispatch(cpu, core, rq);
+        }
+    }
 
-            if (all_halt && cur == NULL && prio_q_empty(cpu->ready) &&
-                prio_q_empty(cpu->blocked) && !message_pending()) {
+    if (process_idle(cpu)) {
+        return 0;
+    }
+    return 1;
+}
+/***
+*This function does the scheduling, one step of the main loop at a time
+*A step runs a node until it next has to synchronize with the other nodes. The first step dispatches
+*the node's first process; every later one resumes where the previous one stopped, given the minimum
+*over all nodes of the values they returned from the last step.
+*By default all nodes tick in lockstep. At every synchronization each node reports its next event and
+*the clocks jump straight to the earliest one, so ticks in which nothing happens on any node are skipped.
+*With lookahead, nodes only synchronize at a horizon: the earliest tick at which any node could
+*send or receive. Before it the nodes are independent, so each one runs ahead on its own events,
+*and the ticks at the horizon are simulated in lockstep. A node that has traced STEP_EVENTS events
+*in a step also stops and synchronizes on its next tick, which holds the other nodes back there
+*until the trace up to it is written out.
+*Returns 1 and stores the value to synchronize on, or 0 once the node has nothing left to do
+*/
+extern int process_step(processor_t *cpu, long long sync, long long *value) {
+    int resumed = cpu->started;
+    if (!cpu->started) {
+        process_start(cpu);
+        cpu->started = 1;
+        cpu->horizon = 0;
+    }
+    else if (!lookahead) {
+        /* A node that starts with nothing ends on its first tick, whatever the other nodes do
+         */
+        if (!process_idle(cpu)) {
+            process_skip(cpu, sync);
+        }
+        if (!process_tick(cpu)) {
+            return 0;
+        }
+    }
+    else {
+        cpu->horizon = sync;
+    }
 
-                for (int i = 0; i < num_ready; i++) {
-                    insert_in_queue(cpu, unblocked[i], 1);
-                }
+    if (!lookahead) {
+        *value = process_next_event(cpu);
+        return 1;
+    }
 
-                barrier_wait();
-                cpu->clock_time++;
-
-                while (!prio_q_empty(cpu->ready)) {
-                    real_priority *proc = prio_q_remove(cpu->ready);
-                    if (proc->id == 2 && proc->wait_time == 0 && proc->wait_count > 0) {
-                        proc->wait_time = 1;
-                    }
-                    proc->state = PROC_FINISHED;
-                    process_finished(cpu, proc);
-                    print_process(cpu, proc);
-                }
-                break;
+    int traced = cpu->trace->count;
+    for (;; resumed = 0) {
+        if (!resumed && cpu->clock_time + 1 >= cpu->horizon) {
+            *value = process_horizon(cpu);
+            return 1;
+        }
+        if (!resumed && cpu->trace->count - traced >= STEP_EVENTS) {
+            *value = cpu->clock_time + 1;
+            return 1;
+        }
+
+        /* A node with nothing left does not wait for the horizon: like in lockstep,
+         * its next tick is its last one.
+         */
+        long long next = process_next_event(cpu);
+        if (cpu->horizon != LLONG_MAX && next >= cpu->horizon && !process_idle(cpu)) {
+            /* Nothing happens here before the horizon, so wait for the other nodes there
+             * and simulate the tick at the horizon in lockstep with them.
+             */
+            if (cpu->horizon > cpu->clock_time + 1) {
+                process_skip(cpu, cpu->horizon);
+                continue;
             }
+            next = cpu->horizon;
+        }
+        process_skip(cpu, next);
+        if (!process_tick(cpu)) {
+            return 0;
         }
+    }
+}
+/***
+*Returns the number of processes running or ready on the node, or -1 while it is halting
+*/
+extern int process_load(processor_t *cpu) {
+    if (cpu->halting) {
+        return -1;
+    }
+    int load = process_queued(cpu);
+    for (int i = 0; i < cpu->num_cores; i++) {
+        load += cpu->cores[i].cur != NULL;
+    }
+    return load;
+}
+/***
+*Returns the number of ready processes that could be moved off the node
+*/
+extern int process_movable(processor_t *cpu) {
+    return cpu->halting ? 0 : process_queued(cpu);
+}
+/***
+*Moves the next ready process of the fullest queue of one node to another node at the given tick
+*The process has waited on its old node until then, and cannot be dispatched on the new one
+*until the migration cost has gone by. A node that was left with nothing to do catches up with the tick.
+*/
+extern void process_migrate(processor_t *from, processor_t *to, long long now, int cost) {
+    assert(process_movable(from) > 0 && !to->halting);
 
-        for (int i = 0; i < num_ready; i++) {
-            insert_in_queue(cpu, unblocked[i], 1);
+    run_queue_t *rq = &from->queues[0];
+    for (int i = 1; i < from->num_queues; i++) {
+        if (from->queues[i].size > rq->size) {
+            rq = &from->queues[i];
         }
+    }
+    real_priority *proc = policy->remove_next(rq->queue);
+    rq->size--;
 
-        while (!prio_q_empty(cpu->blocked)) {
-            real_priority *proc = prio_q_peek(cpu->blocked);
-            if (proc->duration > cpu->clock_time) {
-                break;
+    if (proc->enqueue_time < now) {
+        proc->wait_time += now - proc->enqueue_time;
+        proc->enqueue_time = now;
+    }
+    proc->enqueue_time += cost;
+    proc->node = to->node_id;
+
+    if (to->clock_time < now && process_idle(to)) {
+        to->clock_time = now;
+    }
+    process_push(to, proc);
+
+    trace_add(from->trace, now, proc->thread, proc->id, TRACE_MIGRATED, trace_op(proc), to->node_id);
+}
+/***
+*Merges the trace buffers of the nodes and writes out the events before the given tick
+*/
+extern void process_trace(processor_t **cpus, int num_nodes, long long upto, FILE *fout) {
+    static trace_t **traces = NULL;
+    static int capacity = 0;
+    if (num_nodes > capacity) {
+        capacity = num_nodes;
+        traces = realloc(traces, capacity * sizeof(trace_t *));
+        assert(traces);
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        traces[i] = cpus[i]->trace;
+    }
+    trace_merge(traces, num_nodes, upto, fout);
+}
+/***
+*Appends a process to the array being saved
+*/
+static void save_index(real_priority *proc, void *arg) {
+    int **next = arg;
+    *(*next)++ = checkpoint_index(proc);
+}
+/***
+*Appends a blocked process to the array being saved
+*/
+static void save_blocked(void *contents, long long wake, void *arg) {
+    blocked_record **next = arg;
+    (*next)->proc = checkpoint_index(contents);
+    (*next)->wake = wake;
+    (*next)++;
+}
+/***
+*Saves the settings of the simulation, the finished processes, and every node with its cores,
+*ready queues and blocked processes. Queued processes keep their place through their links,
+*which are saved with the processes.
+*/
+extern void process_save(checkpoint_t *ck, processor_t **cpus, int num_nodes) {
+    process_record settings;
+    memset(&settings, 0, sizeof(settings));
+    strncpy(settings.policy, policy->name, sizeof(settings.policy) - 1);
+    settings.quantum = quantum;
+    settings.lookahead = lookahead;
+    settings.num_cores = num_cores;
+    settings.per_core = per_core_queues;
+    checkpoint_put(ck, &settings, sizeof(settings));
+
+    for (int n = 0; n < num_nodes; n++) {
+        processor_t *cpu = cpus[n];
+        node_record node = {cpu->clock_time, cpu->horizon, cpu->next_proc_id, cpu->node_id,
+                            cpu->halting, cpu->started, cpu->messaging, cpu->num_finished};
+        checkpoint_put(ck, &node, sizeof(node));
+
+        int *indices = malloc((cpu->num_finished + 1) * sizeof(int));
+        assert(indices);
+        for (int i = 0; i < cpu->num_finished; i++) {
+            indices[i] = checkpoint_index(cpu->finished[i]);
+        }
+        checkpoint_put(ck, indices, cpu->num_finished * sizeof(int));
+        free(indices);
+
+        core_record *cores = calloc(cpu->num_cores, sizeof(core_record));
+        assert(cores);
+        for (int i = 0; i < cpu->num_cores; i++) {
+            cores[i].cur = checkpoint_index(cpu->cores[i].cur);
+            cores[i].quantum_left = cpu->cores[i].quantum_left;
+            cores[i].home = (int)(cpu->cores[i].home - cpu->queues);
+            cores[i].busy = cpu->cores[i].busy;
+        }
+        checkpoint_put(ck, cores, cpu->num_cores * sizeof(core_record));
+        free(cores);
+
+        for (int i = 0; i < cpu->num_queues; i++) {
+            run_queue_t *rq = &cpu->queues[i];
+            queue_record queue = {policy->save(rq->queue), rq->size};
+            checkpoint_put(ck, &queue, sizeof(queue));
+
+            int *ready = malloc((rq->size + 1) * sizeof(int));
+            int *next = ready;
+            assert(ready);
+            policy->foreach(rq->queue, save_index, &next);
+            assert(next == ready + rq->size);
+            checkpoint_put(ck, ready, rq->size * sizeof(int));
+            free(ready);
+        }
+
+        /* Blocked processes are saved in the order they wake up, so that adding them back in
+         * that order gives a wheel that wakes them up in the same order.
+         */
+        int num_blocked = cpu->blocked->size;
+        checkpoint_put(ck, &num_blocked, sizeof(int));
+        blocked_record *blocked = malloc((num_blocked + 1) * sizeof(blocked_record));
+        blocked_record *next = blocked;
+        assert(blocked);
+        wheel_foreach_ordered(cpu->blocked, save_blocked, &next);
+        checkpoint_put(ck, blocked, num_blocked * sizeof(blocked_record));
+        free(blocked);
+
+        /* Events the node recorded but that have not been written out yet belong to the
+         * rest of the trace.
+         */
+        checkpoint_put(ck, &cpu->trace->count, sizeof(int));
+        checkpoint_put(ck, cpu->trace->events, cpu->trace->count * sizeof(trace_event_t));
+
+        histogram_save(ck, &cpu->stats.wait);
+        histogram_save(ck, &cpu->stats.response);
+        histogram_save(ck, &cpu->stats.turnaround);
+        histogram_save(ck, &cpu->stats.rendezvous);
+        checkpoint_put(ck, &cpu->stats.switches, sizeof(long long));
+    }
+}
+/***
+*Restores what process_save saved, creating the nodes.
+*The settings of the simulation come from the checkpoint and replace those given to process_init.
+*Returns 1 on success, 0 if the checkpoint is damaged
+*/
+extern int process_restore(checkpoint_t *ck, processor_t **cpus, int num_nodes) {
+    const process_record *settings = checkpoint_get(ck, sizeof(process_record));
+    if (!settings || settings->num_cores <= 0) {
+        return 0;
+    }
+    char name[sizeof(settings->policy) + 1] = {0};
+    memcpy(name, settings->policy, sizeof(settings->policy));
+    const sched_policy_t *sched = sched_find(name);
+    if (!sched) {
+        return 0;
+    }
+    process_init(settings->quantum, settings->lookahead, sched, settings->num_cores, settings->per_core);
+
+    for (int n = 0; n < num_nodes; n++) {
+        processor_t *cpu = process_new();
+        cpus[n] = cpu;
+
+        const node_record *node = checkpoint_get(ck, sizeof(node_record));
+        const int *indices = node && node->num_finished >= 0 ?
+                             checkpoint_get(ck, node->num_finished * sizeof(int)) : NULL;
+        const core_record *cores = indices ? checkpoint_get(ck, cpu->num_cores * sizeof(core_record)) : NULL;
+        if (!cores) {
+            return 0;
+        }
+        cpu->finished_capacity = node->num_finished + 1;
+        cpu->finished = malloc(cpu->finished_capacity * sizeof(real_priority *));
+        assert(cpu->finished);
+        for (int i = 0; i < node->num_finished; i++) {
+            if (!checkpoint_proc(ck, indices[i], &cpu->finished[i]) || !cpu->finished[i]) {
+                return 0;
             }
-            prio_q_remove(cpu->blocked);
-            insert_in_queue(cpu, proc, 1);
         }
+        cpu->num_finished = node->num_finished;
+        cpu->clock_time = node->clock_time;
+        cpu->next_proc_id = node->next_proc_id;
+        cpu->node_id = node->node_id;
+        cpu->halting = node->halting;
+        cpu->started = node->started;
+        cpu->messaging = node->messaging;
+        cpu->horizon = node->horizon;
 
-        if (cur == NULL && !prio_q_empty(cpu->ready)) {
-            real_priority *candidate = prio_q_peek(cpu->ready);
-            if (candidate->enqueue_time <= cpu->clock_time) {
-                cur = prio_q_remove(cpu->ready);
-                if (cur->enqueue_time < cpu->clock_time) {
-                    cur->wait_time += cpu->clock_time - cur->enqueue_time;
+        for (int i = 0; i < cpu->num_cores; i++) {
+            if (!checkpoint_proc(ck, cores[i].cur, &cpu->cores[i].cur) ||
+                cores[i].home < 0 || cores[i].home >= cpu->num_queues) {
+                return 0;
+            }
+            cpu->cores[i].quantum_left = cores[i].quantum_left;
+            cpu->cores[i].home = &cpu->queues[cores[i].home];
+            cpu->cores[i].busy = cores[i].busy;
+        }
+
+        for (int i = 0; i < cpu->num_queues; i++) {
+            const queue_record *queue = checkpoint_get(ck, sizeof(queue_record));
+            const int *ready = queue && queue->size >= 0 ? checkpoint_get(ck, queue->size * sizeof(int)) : NULL;
+            if (!ready) {
+                return 0;
+            }
+            real_priority **procs = malloc((queue->size + 1) * sizeof(real_priority *));
+            assert(procs);
+            for (int j = 0; j < queue->size; j++) {
+                if (!checkpoint_proc(ck, ready[j], &procs[j]) || !procs[j]) {
+                    free(procs);
+                    return 0;
                 }
-                cpu_quantum = quantum;
-                cur->state = PROC_RUNNING;
-                print_process(cpu, cur);
             }
+            policy->restore(cpu->queues[i].queue, queue->state, procs, queue->size);
+            cpu->queues[i].size = queue->size;
+            free(procs);
         }
 
-        if (prio_q_empty(cpu->ready) && prio_q_empty(cpu->blocked) && cur == NULL && !message_pending()) {
-            break;
+        const int *num_blocked = checkpoint_get(ck, sizeof(int));
+        const blocked_record *blocked = num_blocked && *num_blocked >= 0 ?
+                                        checkpoint_get(ck, *num_blocked * sizeof(blocked_record)) : NULL;
+        if (!blocked) {
+            return 0;
+        }
+        for (int i = 0; i < *num_blocked; i++) {
+            real_priority *proc;
+            if (!checkpoint_proc(ck, blocked[i].proc, &proc) || !proc) {
+                return 0;
+            }
+            wheel_add(cpu->blocked, &proc->link, proc, blocked[i].wake);
+        }
+
+        const int *num_events = checkpoint_get(ck, sizeof(int));
+        const trace_event_t *events = num_events && *num_events >= 0 ?
+                                      checkpoint_get(ck, *num_events * sizeof(trace_event_t)) : NULL;
+        if (!events) {
+            return 0;
+        }
+        for (int i = 0; i < *num_events; i++) {
+            if (events[i].state < 0 || events[i].state >= TRACE_LAST) {
+                return 0;
+            }
+            trace_add(cpu->trace, events[i].tick, events[i].thread, events[i].pid, events[i].state,
+                      events[i].op, events[i].arg);
         }
-    }
 
-    complete_barrier();
+        const long long *switches = NULL;
+        if (histogram_restore(ck, &cpu->stats.wait) && histogram_restore(ck, &cpu->stats.response) &&
+            histogram_restore(ck, &cpu->stats.turnaround) && histogram_restore(ck, &cpu->stats.rendezvous)) {
+            switches = checkpoint_get(ck, sizeof(long long));
+        }
+        if (!switches) {
+            return 0;
+        }
+        cpu->stats.switches = *switches;
+    }
     return 1;
 }
 /***
+*Outputs a latency histogram as a JSON object or a CSV line
+*/
+static void report_histogram(const char *name, const histogram_t *hist, FILE *fout, int csv, int last) {
+    const char *format = csv ? "%s,%lld,%lld,%.2f,%lld,%lld,%lld,%lld\n" :
+                               "    \"%s\": {\"count\": %lld, \"min\": %lld, \"mean\": %.2f, \"max\": %lld, "
+                               "\"p50\": %lld, \"p99\": %lld, \"p99.9\": %lld}";
+    fprintf(fout, format, name, hist->count, hist->count ? hist->min : 0, histogram_mean(hist),
+            hist->count ? hist->max : 0, histogram_percentile(hist, 50), histogram_percentile(hist, 99),
+            histogram_percentile(hist, 99.9));
+    if (!csv) {
+        fprintf(fout, last ? "\n" : ",\n");
+    }
+}
+/***
+*Merges the latency histograms of the nodes and outputs their percentiles, then the utilization
+*and context switches of every node
+*/
+extern void process_report(processor_t **cpus, int num_nodes, FILE *fout, int csv) {
+    node_stats_t all;
+    memset(&all, 0, sizeof(all));
+    long long ticks = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        histogram_merge(&all.wait, &cpus[i]->stats.wait);
+        histogram_merge(&all.response, &cpus[i]->stats.response);
+        histogram_merge(&all.turnaround, &cpus[i]->stats.turnaround);
+        histogram_merge(&all.rendezvous, &cpus[i]->stats.rendezvous);
+        if (cpus[i]->clock_time > ticks) {
+            ticks = cpus[i]->clock_time;
+        }
+    }
+
+    if (csv) {
+        fprintf(fout, "metric,count,min,mean,max,p50,p99,p99.9\n");
+    } else {
+        fprintf(fout, "{\n  \"ticks\": %lld,\n  \"latency\": {\n", ticks);
+    }
+    report_histogram("wait", &all.wait, fout, csv, 0);
+    report_histogram("response", &all.response, fout, csv, 0);
+    report_histogram("turnaround", &all.turnaround, fout, csv, 0);
+    report_histogram("rendezvous", &all.rendezvous, fout, csv, 1);
+    fprintf(fout, csv ? "\nnode,ticks,cores,busy,utilization,context_switches\n" : "  },\n  \"nodes\": [\n");
+
+    for (int i = 0; i < num_nodes; i++) {
+        processor_t *cpu = cpus[i];
+        long long busy = 0;
+        for (int j = 0; j < cpu->num_cores; j++) {
+            busy += cpu->cores[j].busy;
+        }
+        double utilization = cpu->clock_time > 0 ? (double)busy / ((double)cpu->clock_time * cpu->num_cores) : 0.0;
+        const char *format = csv ? "%d,%lld,%d,%lld,%.3f,%lld\n" :
+                                   "    {\"node\": %d, \"ticks\": %lld, \"cores\": %d, \"busy\": %lld, "
+                                   "\"utilization\": %.3f, \"context_switches\": %lld}";
+        fprintf(fout, format, cpu->node_id, cpu->clock_time, cpu->num_cores, busy, utilization,
+                cpu->stats.switches);
+        if (!csv) {
+            fprintf(fout, i + 1 < num_nodes ? ",\n" : "\n");
+        }
+    }
+    if (!csv) {
+        fprintf(fout, "  ]\n}\n");
+    }
+    free(all.wait.counts);
+    free(all.response.counts);
+    free(all.turnaround.counts);
+    free(all.rendezvous.counts);
+}
+/***
+*Outputs how busy each core of a node was over the node's run
+*/
+extern void process_utilization(processor_t *cpu, FILE *fout) {
+    for (int i = 0; i < cpu->num_cores; i++) {
+        long long busy = cpu->cores[i].busy;
+        double percent = cpu->clock_time > 0 ? 100.0 * busy / cpu->clock_time : 0.0;
+        fprintf(fout, "| Node %2.2d | Core %2.2d | Busy %lld of %lld ticks (%.1f%%)\n",
+                cpu->node_id, i, busy, cpu->clock_time, percent);
+    }
+}
+/***
+*Moves the list at index i of the heap towards the leaves until the heap order on the next
+*process of each list is restored
+*/
+static void summary_sift(summary_cursor *heap, int size, int i) {
+    for (;;) {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < size && finished_before(*heap[left].next, *heap[least].next)) {
+            least = left;
+        }
+        if (right < size && finished_before(*heap[right].next, *heap[least].next)) {
+            least = right;
+        }
+        if (least == i) {
+            return;
+        }
+        summary_cursor swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+/***
 *Does the process summary
+*The finished list of each node is in summary order, so the lists are merged with a heap
+*holding the next process of every list that has some left.
 */
-extern void process_summary(FILE *fout) {
-    while (!prio_q_empty(finished)) {
-        real_priority *proc = prio_q_remove(finished);
-        context_stats(proc, fout);
+extern void process_summary(processor_t **cpus, int num_nodes, FILE *fout) {
+    summary_cursor *heap = malloc((num_nodes + 1) * sizeof(summary_cursor));
+    assert(heap);
+    int size = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        if (cpus[i]->num_finished > 0) {
+            heap[size].next = cpus[i]->finished;
+            heap[size].end = cpus[i]->finished + cpus[i]->num_finished;
+            size++;
+        }
+    }
+    for (int i = size / 2 - 1; i >= 0; i--) {
+        summary_sift(heap, size, i);
+    }
+
+    while (size > 0) {
+        context_stats(*heap[0].next++, fout);
+        if (heap[0].next == heap[0].end) {
+            heap[0] = heap[--size];
+        }
+        summary_sift(heap, size, 0);
     }
+    free(heap);
 }
\ No newline at end of file
@@ -2,24 +2,67 @@
 #ifndef PROSIM_PROCESS_H
 #define PROSIM_PROCESS_H
 #include "prio_q.h"
+#include "wheel.h"
 #include "context.h"
+#include "sched.h"
+#include "trace.h"
+#include "histogram.h"
 
+struct checkpoint;
+
+
+typedef struct run_queue {
+    void *queue;             /* ready processes, owned by the scheduling policy */
+    int size;                /* number of processes in the queue */
+} run_queue_t;
+
+typedef struct core {
+    real_priority *cur;      /* running process or NULL if the core is idle */
+    int quantum_left;        /* ticks left in the quantum of the running process */
+    run_queue_t *home;       /* queue the core dispatches from, unless it is empty and can be stolen from */
+    long long busy;          /* ticks spent running a process */
+} core_t;
+
+typedef struct node_stats {
+    histogram_t wait;        /* ticks from becoming ready to being dispatched, per dispatch */
+    histogram_t response;    /* ticks from admission to first dispatch, per process */
+    histogram_t turnaround;  /* ticks from admission to finishing, per process */
+    histogram_t rendezvous;  /* ticks blocked waiting for the other side, per message primitive */
+    long long switches;      /* number of times a core switched to a process */
+} node_stats_t;
 
 typedef struct processor {
-    prio_q_t *blocked;       /* queue for blocked processes on node */
-    prio_q_t *ready;         /* queue for blocked processes on node */
-    int clock_time;          /* local node time */
+    wheel_t *blocked;        /* timing wheel of blocked processes on node, keyed on wake-up time */
+    trace_t *trace;          /* state changes of the processes on node not written out yet */
+    run_queue_t *queues;     /* one ready queue shared by the cores, or one per core */
+    int num_queues;
+    core_t *cores;           /* simulated cores of the node */
+    int num_cores;
+    long long clock_time;    /* local node time */
     int next_proc_id;        /* local node process counter */
     int node_id;
+    int halting;             /* 1 if the ready processes are to finish on the next tick */
+    int started;             /* 1 once the first process has been dispatched */
+    int messaging;           /* processes of the node blocked on a message, given back by message_ready */
+    long long horizon;       /* with lookahead, the tick up to which the node may run alone */
+    node_stats_t stats;      /* latencies of the processes on node, recorded by the node alone */
+    real_priority **finished; /* processes finished on node, in summary order, appended by the node alone */
+    int num_finished;
+    int finished_capacity;
 } processor_t;
 
 /* Initialize the simulation
  * @params:
  *   quantum: the CPU quantum to use in the situation
+ *   lookahead: 1 to let nodes run ahead of each other until one could send or receive
+ *   policy: scheduling policy of every node
+ *   cores: number of cores of every node
+ *   per_core: 1 to give each core its own ready queue, 0 for one queue shared by the cores
  * @returns:
  *   returns 1
  */
-extern void process_init(int cpu_quantum);
+extern void process_init(int cpu_quantum, int lookahead, const sched_policy_t *policy,
+                         int cores, int per_core);
 
 /* Create a new node context
  * @params:
@@ -38,20 +81,103 @@ extern processor_t *process_new();
  */
 extern int process_admit(processor_t *cpu, real_priority *proc);
 
-/* Perform the simulation
+/* Run a node until it next has to synchronize with the other nodes
  * @params:
- *   cpu : node context
+ *   cpu  : node context
+ *   sync : minimum over all nodes of the values stored by their previous step, ignored on the first step
+ *   value: where to store the value this node synchronizes on
  * @returns:
- *   returns 1
+ *   1 if the node takes part in the next synchronization, 0 once it has nothing left to do
+ */
+extern int process_step(processor_t *cpu, long long sync, long long *value);
+
+/* Returns how loaded a node is, for balancing the load of the nodes
+ * @params:
+ *   cpu  : node context
+ * @returns:
+ *   number of processes running or ready on the node, or -1 if the node is halting and takes no part
+ */
+extern int process_load(processor_t *cpu);
+
+/* Returns the number of ready processes a node could give up to another node
+ * @params:
+ *   cpu  : node context
+ * @returns:
+ *   number of ready processes, 0 if the node is halting
  */
-extern int process_simulate(processor_t *cpu);
+extern int process_movable(processor_t *cpu);
 
-/* Output process summary post execution
+/* Move a ready process from one node to another, between two steps of the nodes
  * @params:
+ *   from : node context with at least one movable process
+ *   to   : node context, not halting
+ *   now  : tick at which the process moves, no earlier than the clock of either node
+ *   cost : number of ticks the process cannot run for after moving
+ * @returns:
+ *   none
+ */
+extern void process_migrate(processor_t *from, processor_t *to, long long now, int cost);
+
+/* Write out the trace of every node up to a tick, between two steps of the nodes
+ * @params:
+ *   cpus     : node contexts
+ *   num_nodes: number of nodes
+ *   upto     : tick from which events stay buffered, as a node could still record earlier ones
+ *   fout     : output file
+ * @returns:
+ *   none
+ */
+extern void process_trace(processor_t **cpus, int num_nodes, long long upto, FILE *fout);
+
+/* Save the settings of the simulation, the finished processes and the state of every node
+ * @params:
+ *   ck       : checkpoint being written, after the processes
+ *   cpus     : node contexts
+ *   num_nodes: number of nodes
+ * @returns:
+ *   none
+ */
+extern void process_save(struct checkpoint *ck, processor_t **cpus, int num_nodes);
+
+/* Restore what process_save saved, initializing the simulation with the saved settings
+ * @params:
+ *   ck       : checkpoint being restored, after the processes
+ *   cpus     : array to fill with the restored node contexts
+ *   num_nodes: number of nodes
+ * @returns:
+ *   1 on success, 0 if the checkpoint is damaged
+ */
+extern int process_restore(struct checkpoint *ck, processor_t **cpus, int num_nodes);
+
+/* Output the latency percentiles of all processes and the utilization and context switches of each node
+ * post execution
+ * @params:
+ *   cpus     : node contexts
+ *   num_nodes: number of nodes
+ *   fout     : output file
+ *   csv      : 1 for CSV, 0 for JSON
+ * @returns:
+ *   none
+ */
+extern void process_report(processor_t **cpus, int num_nodes, FILE *fout, int csv);
+
+/* Output the utilization of each core of a node post execution
+ * @params:
+ *   cpu  : node context
  *   fout : output file
  * @returns:
  *   none
  */
-extern void process_summary(FILE *fout);
+extern void process_utilization(processor_t *cpu, FILE *fout);
+
+/* Output process summary post execution, ordered by finishing time, then node, then process id
+ * @params:
+ *   cpus     : node contexts
+ *   num_nodes: number of nodes
+ *   fout     : output file
+ * @returns:
+ *   none
+ */
+extern void process_summary(processor_t **cpus, int num_nodes, FILE *fout);
 
 #endif //PROSIM_PROCESS_H
@@ -0,0 +1,101 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "trace.h"
+
+/* Returns the index of the first record at or after the given tick, the records being in tick order
+ */
+static size_t first_record(const trace_event_t *records, size_t count, long long tick) {
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (records[mid].tick < tick) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Decodes a binary trace written by prosim --trace
+ * @params:
+ *   argc, argv : command line options, then the trace file
+ *     --node N keeps the events of processes of node N
+ *     --pid P keeps the events of processes with id P
+ *     --from T keeps the events at tick T or later
+ *     --to T keeps the events at tick T or earlier
+ * @returns:
+ *   0, or -1 if the trace could not be read
+ */
+int main(int argc, char **argv) {
+    int node = 0;
+    int pid = 0;
+    long long from = 0;
+    long long to = LLONG_MAX;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--node") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            node = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--pid") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            pid = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--from") && i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+            from = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "--to") && i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+            to = atoll(argv[++i]);
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "Usage: %s [--node N] [--pid P] [--from T] [--to T] FILE\n", argv[0]);
+        return -1;
+    }
+
+    /* Map the trace and check that it is a whole number of records of this version
+     */
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Bad trace, could not open %s\n", path);
+        return -1;
+    }
+    size_t size = st.st_size;
+    const char *base = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    const trace_header_t *header = (const trace_header_t *)base;
+    if (base == MAP_FAILED || size < sizeof(trace_header_t) ||
+        memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) ||
+        header->version != TRACE_VERSION || header->record_size != sizeof(trace_event_t)) {
+        fprintf(stderr, "Bad trace, %s is not a trace of this version\n", path);
+        return -1;
+    }
+    if ((size - sizeof(trace_header_t)) % sizeof(trace_event_t)) {
+        fprintf(stderr, "Bad trace, %s is truncated\n", path);
+        return -1;
+    }
+
+    const trace_event_t *records = (const trace_event_t *)(base + sizeof(trace_header_t));
+    size_t count = (size - sizeof(trace_header_t)) / sizeof(trace_event_t);
+    for (size_t i = first_record(records, count, from); i < count && records[i].tick <= to; i++) {
+        const trace_event_t *event = &records[i];
+        if (event->state < 0 || event->state >= TRACE_LAST) {
+            fprintf(stderr, "Bad trace, record %zu of %s is damaged\n", i, path);
+            return -1;
+        }
+        if ((node == 0 || event->thread == node) && (pid == 0 || event->pid == pid)) {
+            trace_print(event, stdout);
+        }
+    }
+    return 0;
+}
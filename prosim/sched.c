@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "sched.h"
+
+/* Levels of the multi-level feedback queue, the quantum doubles at each level down
+ */
+#define MLFQ_LEVELS 3
+/* Number of base quanta of running time after which every MLFQ process goes back to the top level
+ */
+#define MLFQ_BOOST 32
+
+/* Queue of the policies that keep a single heap: prio, rr, srtf, edf and cfs.
+ * They only differ in the key a process is queued on. Equal keys leave in the order they were
+ * queued (see prio_q.h), so a constant key gives a FIFO queue.
+ */
+typedef struct heap_queue {
+    prio_q_t *heap;
+    int quantum;
+    long long min_vruntime; /* cfs: smallest virtual runtime a process may be queued with */
+} heap_queue_t;
+
+/* Queue of the multi-level feedback queue policy: one FIFO queue per level.
+ */
+typedef struct mlfq_queue {
+    prio_q_t *levels[MLFQ_LEVELS];
+    int quantum;
+    long long since_boost;  /* ticks run since processes were last moved back to the top level */
+} mlfq_queue_t;
+
+/* Creates a heap queue
+ * @params:
+ *   quantum: the CPU quantum of the run
+ * @returns:
+ *   pointer to the new queue
+ */
+static void *heap_create(int quantum) {
+    heap_queue_t *queue = calloc(1, sizeof(heap_queue_t));
+    assert(queue);
+    queue->heap = prio_q_new();
+    assert(queue->heap);
+    queue->quantum = quantum;
+    return queue;
+}
+
+static real_priority *heap_select_next(void *queue) {
+    heap_queue_t *q = queue;
+    return prio_q_empty(q->heap) ? NULL : prio_q_peek(q->heap);
+}
+
+static real_priority *heap_remove_next(void *queue) {
+    heap_queue_t *q = queue;
+    return prio_q_remove(q->heap);
+}
+
+static int heap_quantum(void *queue, real_priority *proc) {
+    heap_queue_t *q = queue;
+    return q->quantum;
+}
+
+static void heap_foreach(void *queue, void (*visit)(real_priority *proc, void *arg), void *arg) {
+    heap_queue_t *q = queue;
+    for (int i = 0; i < q->heap->size; i++) {
+        visit(q->heap->heap[i]->contents, arg);
+    }
+}
+
+static int heap_empty(void *queue) {
+    heap_queue_t *q = queue;
+    return prio_q_empty(q->heap);
+}
+
+static long long heap_save(void *queue) {
+    heap_queue_t *q = queue;
+    return q->min_vruntime;
+}
+
+static void heap_restore(void *queue, long long state, real_priority **procs, int count) {
+    heap_queue_t *q = queue;
+    q->min_vruntime = state;
+    for (int i = 0; i < count; i++) {
+        prio_q_relink(q->heap, &procs[i]->link, procs[i], procs[i]->link.priority, procs[i]->link.seq);
+    }
+}
+
+static void no_tick(void *queue, real_priority *proc, long long elapsed) {
+}
+
+static void no_expiry(void *queue, real_priority *proc) {
+}
+
+/* Static priority, or the remaining duration of the current primitive for negative priorities
+ * @params:
+ *   proc: pointer to process context
+ * @returns:
+ *   the key, lower is dispatched first
+ */
+static long long actual_priority(real_priority *proc) {
+    if (proc->priority < 0) {
+        return proc->duration;
+    }
+    return proc->priority;
+}
+
+/* prio: the simulator's original policy, ordered on actual_priority
+ */
+static void prio_enqueue(void *queue, real_priority *proc, long long now) {
+    heap_queue_t *q = queue;
+    prio_q_add_node(q->heap, &proc->link, proc, actual_priority(proc));
+}
+
+/* rr: round robin, first come first served with the fixed quantum
+ */
+static void rr_enqueue(void *queue, real_priority *proc, long long now) {
+    heap_queue_t *q = queue;
+    prio_q_add_node(q->heap, &proc->link, proc, 0);
+}
+
+/* srtf: shortest remaining time first, ordered on what is left of the current primitive.
+ * A process only gives up the node at the end of its primitive or quantum.
+ */
+static void srtf_enqueue(void *queue, real_priority *proc, long long now) {
+    heap_queue_t *q = queue;
+    prio_q_add_node(q->heap, &proc->link, proc, proc->duration);
+}
+
+/* edf: earliest deadline first. The priority of a process is its relative deadline: a process that
+ * becomes ready at tick t is due at t + priority (the remaining duration for negative priorities).
+ */
+static void edf_enqueue(void *queue, real_priority *proc, long long now) {
+    heap_queue_t *q = queue;
+    prio_q_add_node(q->heap, &proc->link, proc, now + actual_priority(proc));
+}
+
+/* cfs: completely fair scheduling, ordered on virtual runtime.
+ * Running time is charged to the virtual runtime scaled by the priority, so lower priority values
+ * get a larger share of the node. A process that has been away is queued no earlier than the
+ * processes already waiting, so it cannot starve them with runtime it did not use.
+ */
+static void cfs_enqueue(void *queue, real_priority *proc, long long now) {
+    heap_queue_t *q = queue;
+    if (proc->vruntime < q->min_vruntime) {
+        proc->vruntime = q->min_vruntime;
+    }
+    prio_q_add_node(q->heap, &proc->link, proc, proc->vruntime);
+}
+
+static real_priority *cfs_remove_next(void *queue) {
+    heap_queue_t *q = queue;
+    real_priority *proc = prio_q_remove(q->heap);
+    if (proc->vruntime > q->min_vruntime) {
+        q->min_vruntime = proc->vruntime;
+    }
+    return proc;
+}
+
+static void cfs_on_tick(void *queue, real_priority *proc, long long elapsed) {
+    proc->vruntime += elapsed * (1 + (proc->priority > 0 ? proc->priority : 0));
+}
+
+/* mlfq: multi-level feedback queue. Processes start on the top level and drop a level each time
+ * they use up their quantum, which doubles on every level down. A process that gives up the node
+ * early keeps its level. The highest non-empty level goes first, first come first served within it.
+ * Every so often all processes go back to the top level so that long-running ones are not starved.
+ */
+static void *mlfq_create(int quantum) {
+    mlfq_queue_t *queue = calloc(1, sizeof(mlfq_queue_t));
+    assert(queue);
+    for (int i = 0; i < MLFQ_LEVELS; i++) {
+        queue->levels[i] = prio_q_new();
+        assert(queue->levels[i]);
+    }
+    queue->quantum = quantum;
+    return queue;
+}
+
+static void mlfq_enqueue(void *queue, real_priority *proc, long long now) {
+    mlfq_queue_t *q = queue;
+    prio_q_add_node(q->levels[proc->sched_level], &proc->link, proc, 0);
+}
+
+static real_priority *mlfq_select_next(void *queue) {
+    mlfq_queue_t *q = queue;
+    for (int i = 0; i < MLFQ_LEVELS; i++) {
+        if (!prio_q_empty(q->levels[i])) {
+            return prio_q_peek(q->levels[i]);
+        }
+    }
+    return NULL;
+}
+
+static real_priority *mlfq_remove_next(void *queue) {
+    mlfq_queue_t *q = queue;
+    for (int i = 0; i < MLFQ_LEVELS; i++) {
+        if (!prio_q_empty(q->levels[i])) {
+            return prio_q_remove(q->levels[i]);
+        }
+    }
+    return NULL;
+}
+
+static int mlfq_quantum(void *queue, real_priority *proc) {
+    mlfq_queue_t *q = queue;
+    return q->quantum << proc->sched_level;
+}
+
+static void mlfq_on_tick(void *queue, real_priority *proc, long long elapsed) {
+    mlfq_queue_t *q = queue;
+    /* Skipped ticks arrive in one call, so keep what is left over past the boost.
+     */
+    q->since_boost += elapsed;
+    if (q->since_boost < MLFQ_BOOST * q->quantum) {
+        return;
+    }
+
+    q->since_boost %= MLFQ_BOOST * q->quantum;
+    proc->sched_level = 0;
+    for (int i = 1; i < MLFQ_LEVELS; i++) {
+        while (!prio_q_empty(q->levels[i])) {
+            real_priority *waiting = prio_q_remove(q->levels[i]);
+            waiting->sched_level = 0;
+            prio_q_add_node(q->levels[0], &waiting->link, waiting, 0);
+        }
+    }
+}
+
+static void mlfq_on_quantum_expiry(void *queue, real_priority *proc) {
+    if (proc->sched_level < MLFQ_LEVELS - 1) {
+        proc->sched_level++;
+    }
+}
+
+static void mlfq_foreach(void *queue, void (*visit)(real_priority *proc, void *arg), void *arg) {
+    mlfq_queue_t *q = queue;
+    for (int i = 0; i < MLFQ_LEVELS; i++) {
+        for (int j = 0; j < q->levels[i]->size; j++) {
+            visit(q->levels[i]->heap[j]->contents, arg);
+        }
+    }
+}
+
+static int mlfq_empty(void *queue) {
+    return mlfq_select_next(queue) == NULL;
+}
+
+/* A queued process is on the level of its sched_level, so only the boost clock needs saving.
+ */
+static long long mlfq_save(void *queue) {
+    mlfq_queue_t *q = queue;
+    return q->since_boost;
+}
+
+static void mlfq_restore(void *queue, long long state, real_priority **procs, int count) {
+    mlfq_queue_t *q = queue;
+    q->since_boost = state;
+    for (int i = 0; i < count; i++) {
+        prio_q_relink(q->levels[procs[i]->sched_level], &procs[i]->link, procs[i],
+                      procs[i]->link.priority, procs[i]->link.seq);
+    }
+}
+
+static const sched_policy_t policies[] = {
+    {"prio", heap_create, prio_enqueue, heap_select_next, heap_remove_next, heap_quantum,
+     no_tick, no_expiry, heap_foreach, heap_empty,
+     heap_save, heap_restore},
+    {"rr", heap_create, rr_enqueue, heap_select_next, heap_remove_next, heap_quantum,
+     no_tick, no_expiry, heap_foreach, heap_empty,
+     heap_save, heap_restore},
+    {"srtf", heap_create, srtf_enqueue, heap_select_next, heap_remove_next, heap_quantum,
+     no_tick, no_expiry, heap_foreach, heap_empty,
+     heap_save, heap_restore},
+    {"mlfq", mlfq_create, mlfq_enqueue, mlfq_select_next, mlfq_remove_next, mlfq_quantum,
+     mlfq_on_tick, mlfq_on_quantum_expiry, mlfq_foreach, mlfq_empty,
+     mlfq_save, mlfq_restore},
+    {"edf", heap_create, edf_enqueue, heap_select_next, heap_remove_next, heap_quantum,
+     no_tick, no_expiry, heap_foreach, heap_empty,
+     heap_save, heap_restore},
+    {"cfs", heap_create, cfs_enqueue, heap_select_next, cfs_remove_next, heap_quantum,
+     cfs_on_tick, no_expiry, heap_foreach, heap_empty,
+     heap_save, heap_restore},
+};
+
+#define NUM_POLICIES (int)(sizeof(policies) / sizeof(policies[0]))
+
+extern const sched_policy_t *sched_find(const char *name) {
+    for (int i = 0; i < NUM_POLICIES; i++) {
+        if (!strcmp(policies[i].name, name)) {
+            return &policies[i];
+        }
+    }
+    return NULL;
+}
+
+extern const char *sched_names() {
+    return "prio|rr|srtf|mlfq|edf|cfs";
+}
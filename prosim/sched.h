@@ -0,0 +1,113 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "context.h"
+
+/* Scheduling policies of a node.
+ * A policy owns the ready queue of each node: it decides where a process goes when it becomes ready,
+ * which process is dispatched next and for how long, and how running time and used-up quanta affect
+ * a process. The simulator only goes through the table of functions below, so a policy is chosen
+ * per run without touching process.c.
+ * Queues are only used by the thread stepping their node, so policies need no locking.
+ */
+
+typedef struct sched_policy {
+    const char *name;
+
+    /* Creates the ready queue of a node
+     * @params:
+     *   quantum: the CPU quantum of the run
+     * @returns:
+     *   pointer to the new queue
+     */
+    void *(*create)(int quantum);
+
+    /* Adds a process that has become ready
+     * @params:
+     *   queue: ready queue
+     *   proc : the process, with its duration set to what is left of its current primitive
+     *   now  : current node time
+     */
+    void (*enqueue)(void *queue, real_priority *proc, long long now);
+
+    /* Returns the process to dispatch next without removing it, or NULL if the queue is empty
+     * @params:
+     *   queue: ready queue
+     */
+    real_priority *(*select_next)(void *queue);
+
+    /* Removes and returns the process select_next returns
+     * @params:
+     *   queue: ready queue, not empty
+     */
+    real_priority *(*remove_next)(void *queue);
+
+    /* Returns the number of ticks a process may run once dispatched
+     * @params:
+     *   queue: ready queue
+     *   proc : the process being dispatched
+     */
+    int (*quantum)(void *queue, real_priority *proc);
+
+    /* Accounts for ticks the running process has run
+     * @params:
+     *   queue  : ready queue
+     *   proc   : the running process
+     *   elapsed: number of ticks run since the last call
+     */
+    void (*on_tick)(void *queue, real_priority *proc, long long elapsed);
+
+    /* Called when the running process has used up its quantum, before it is enqueued again
+     * @params:
+     *   queue: ready queue
+     *   proc : the preempted process
+     */
+    void (*on_quantum_expiry)(void *queue, real_priority *proc);
+
+    /* Calls visit on every process in the queue, in no particular order
+     * @params:
+     *   queue: ready queue
+     *   visit: function to call
+     *   arg  : passed on to visit
+     */
+    void (*foreach)(void *queue, void (*visit)(real_priority *proc, void *arg), void *arg);
+
+    /* Returns true if the queue is empty
+     * @params:
+     *   queue: ready queue
+     */
+    int (*empty)(void *queue);
+
+    /* Returns the state of a queue that is not kept in its processes, for a checkpoint
+     * @params:
+     *   queue: ready queue
+     */
+    long long (*save)(void *queue);
+
+    /* Restores a queue from a checkpoint
+     * @params:
+     *   queue: empty ready queue
+     *   state: what save returned
+     *   procs: the processes that were queued, with their links as they were (see prio_q_relink)
+     *   count: number of processes
+     */
+    void (*restore)(void *queue, long long state, real_priority **procs, int count);
+} sched_policy_t;
+
+/* Finds a scheduling policy by name
+ * @params:
+ *   name: one of prio, rr, srtf, mlfq, edf or cfs
+ * @returns:
+ *   pointer to the policy or NULL if there is no such policy
+ */
+extern const sched_policy_t *sched_find(const char *name);
+
+/* Returns the names of all policies, separated by '|', for usage messages
+ * @params:
+ *   none
+ * @returns:
+ *   the names
+ */
+extern const char *sched_names();
+
+#endif
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+# Checks the statistics of the summary against what the programs perform.
+# Run, Block, Sends and Recvs only depend on the programs, so they must come out the same
+# with or without fusion, cores, lookahead or another policy. The processes woken by a
+# message start with a fused loop or a BLOCK, which must be counted once.
+#
+# USAGE:
+#   ./summary_test.sh [prosim]
+
+EXE=${1:-./prosim}
+if [ ! -x $EXE ]; then
+	echo Cannot find $EXE
+	exit 1
+fi
+RUN="timeout 10 $EXE"
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+cat > $DIR/input.txt <<EOF
+4 5 1
+A 5 1 1
+RECV 102
+LOOP 100
+DOOP 3
+END
+HALT
+B 3 1 1
+DOOP 4
+SEND 101
+HALT
+C 6 2 1
+RECV 104
+BLOCK 6
+LOOP 2
+DOOP 2
+END
+HALT
+D 3 2 1
+DOOP 2
+SEND 103
+HALT
+EOF
+
+# A message primitive takes a tick of running time
+cat > $DIR/expected.txt <<EOF
+Proc 01.01 | Run 301, Block 0, Sends 0, Recvs 1
+Proc 01.02 | Run 5, Block 0, Sends 1, Recvs 0
+Proc 01.03 | Run 5, Block 6, Sends 0, Recvs 1
+Proc 01.04 | Run 3, Block 0, Sends 1, Recvs 0
+EOF
+
+CONFIGS=(
+	""
+	"--fuse"
+	"--lookahead"
+	"--fuse --lookahead"
+	"--fuse --cores 2"
+	"--sched rr --fuse"
+)
+
+failed=0
+for config in "${CONFIGS[@]}"; do
+	$RUN --sequential $config < $DIR/input.txt > $DIR/output.txt 2>&1
+	grep '| Proc' $DIR/output.txt | sed -E 's/^\| [0-9]+ \| //; s/ Wait [0-9]+,//' | sort > $DIR/stats.txt
+	if ! cmp -s $DIR/expected.txt $DIR/stats.txt; then
+		echo "FAIL ${config:-default}:"
+		diff $DIR/expected.txt $DIR/stats.txt
+		failed=1
+		continue
+	fi
+	echo "ok ${config:-default}"
+done
+
+if [ $failed -ne 0 ]; then
+	echo Summary statistics FAILED
+	exit 1
+fi
+echo Summary statistics passed
@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define INITIAL_EVENTS 64
+#define SINK_WINDOW (16 << 20)
+
+static const char *state_names[] = {
+    "new", "ready", "running", "blocked", "finished",
+    "blocked (send)", "blocked (recv)", "blocked (bcast)", "blocked (gather)", "blocked (barrier)",
+    "migrated to node"
+};
+
+/* Binary trace file, written through a window of it mapped at a time
+ */
+static int sink_fd = -1;
+static char *sink_window = NULL;
+static off_t sink_start;        /* offset of the window in the file */
+static off_t sink_end;          /* bytes written to the file */
+
+/* Buffer being merged: the events it writes out this time and the next one to go
+ */
+typedef struct {
+    trace_event_t *events;
+    int count;
+    int next;
+    int node;
+} merge_source;
+
+extern trace_t *trace_new() {
+    trace_t *trace = calloc(1, sizeof(trace_t));
+    assert(trace);
+    trace->sorted = 1;
+    return trace;
+}
+
+extern void trace_add(trace_t *trace, long long tick, int thread, int pid, int state, int op, int arg) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? 2 * trace->capacity : INITIAL_EVENTS;
+        trace->events = realloc(trace->events, trace->capacity * sizeof(trace_event_t));
+        assert(trace->events);
+    }
+    if (trace->count > 0 && tick < trace->events[trace->count - 1].tick) {
+        trace->sorted = 0;
+    }
+    trace_event_t *event = &trace->events[trace->count++];
+    event->tick = tick;
+    event->thread = thread;
+    event->pid = pid;
+    event->state = (short)state;
+    event->op = (short)op;
+    event->arg = arg;
+}
+
+extern void trace_print(const trace_event_t *event, FILE *fout) {
+    assert(event->state >= 0 && event->state < TRACE_LAST);
+    if (event->state == TRACE_MIGRATED) {
+        fprintf(fout, "[%2.2d] %5.5lld: process %d %s %d\n", event->thread, event->tick, event->pid,
+                state_names[event->state], event->arg);
+    } else {
+        fprintf(fout, "[%2.2d] %5.5lld: process %d %s\n", event->thread, event->tick, event->pid,
+                state_names[event->state]);
+    }
+}
+
+/***
+*Appends bytes to the binary trace file, moving the window on and growing the file when they do not fit
+*/
+static void sink_write(const void *data, size_t size) {
+    if (sink_window == NULL || sink_end + (off_t)size > sink_start + SINK_WINDOW) {
+        if (sink_window != NULL) {
+            munmap(sink_window, SINK_WINDOW);
+        }
+        sink_start = sink_end - sink_end % sysconf(_SC_PAGESIZE);
+        int result = ftruncate(sink_fd, sink_start + SINK_WINDOW);
+        assert(result == 0);
+        sink_window = mmap(NULL, SINK_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, sink_fd, sink_start);
+        assert(sink_window != MAP_FAILED);
+    }
+    memcpy(sink_window + (sink_end - sink_start), data, size);
+    sink_end += size;
+}
+
+extern int trace_open(const char *path) {
+    sink_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (sink_fd < 0) {
+        return 0;
+    }
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_event_t);
+    sink_write(&header, sizeof(header));
+    return 1;
+}
+
+extern void trace_close() {
+    if (sink_fd < 0) {
+        return;
+    }
+    munmap(sink_window, SINK_WINDOW);
+    int result = ftruncate(sink_fd, sink_end);
+    assert(result == 0);
+    close(sink_fd);
+    sink_fd = -1;
+    sink_window = NULL;
+}
+
+/* Orders events on tick, keeping the order they were written in otherwise
+ */
+static void trace_sort(trace_t *trace) {
+    /* Out of order events are rare and close to their place, so an insertion sort is enough
+     */
+    for (int i = 1; i < trace->count; i++) {
+        trace_event_t event = trace->events[i];
+        int j = i;
+        while (j > 0 && trace->events[j - 1].tick > event.tick) {
+            trace->events[j] = trace->events[j - 1];
+            j--;
+        }
+        trace->events[j] = event;
+    }
+    trace->sorted = 1;
+}
+
+/* Returns true if the next event of source a goes before the next event of source b
+ */
+static int source_before(const merge_source *a, const merge_source *b) {
+    long long x = a->events[a->next].tick;
+    long long y = b->events[b->next].tick;
+    return x < y || (x == y && a->node < b->node);
+}
+
+/* Moves the source at index i of the heap towards the leaves until the heap order is restored
+ */
+static void source_sift(merge_source *heap, int size, int i) {
+    for (;;) {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < size && source_before(&heap[left], &heap[least])) {
+            least = left;
+        }
+        if (right < size && source_before(&heap[right], &heap[least])) {
+            least = right;
+        }
+        if (least == i) {
+            return;
+        }
+        merge_source swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+/***
+*Merges the buffers with a heap holding the next event of each one, then keeps what is left of each
+*buffer for the next merge
+*/
+extern void trace_merge(trace_t **traces, int n, long long upto, FILE *fout) {
+    static merge_source *heap = NULL;
+    static int capacity = 0;
+    if (n > capacity) {
+        capacity = n;
+        heap = realloc(heap, capacity * sizeof(merge_source));
+        assert(heap);
+    }
+
+    int size = 0;
+    for (int i = 0; i < n; i++) {
+        trace_t *trace = traces[i];
+        if (!trace->sorted) {
+            trace_sort(trace);
+        }
+        int count = 0;
+        while (count < trace->count && trace->events[count].tick < upto) {
+            count++;
+        }
+        if (count > 0) {
+            heap[size].events = trace->events;
+            heap[size].count = count;
+            heap[size].next = 0;
+            heap[size].node = i;
+            size++;
+        }
+    }
+    for (int i = size / 2 - 1; i >= 0; i--) {
+        source_sift(heap, size, i);
+    }
+
+    while (size > 0) {
+        const trace_event_t *event = &heap[0].events[heap[0].next++];
+        if (sink_fd >= 0) {
+            sink_write(event, sizeof(trace_event_t));
+        } else {
+            trace_print(event, fout);
+        }
+        if (heap[0].next == heap[0].count) {
+            trace_t *trace = traces[heap[0].node];
+            trace->count -= heap[0].count;
+            memmove(trace->events, trace->events + heap[0].count, trace->count * sizeof(trace_event_t));
+            heap[0] = heap[--size];
+        }
+        source_sift(heap, size, 0);
+    }
+}
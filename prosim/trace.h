@@ -0,0 +1,108 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#define TRACE_MAGIC "PROSIMTR"
+#define TRACE_VERSION 2
+
+/* Trace of the state changes of the processes.
+ * Every node writes its events into its own buffer, so tracing takes no lock. Between rounds of the
+ * engine the buffers are merged into one trace ordered on tick, then on the node that wrote the event,
+ * then on the order the node wrote its events in. The trace is then the same however the nodes are
+ * spread over threads and whatever order they ran in.
+ * The merged trace goes out as text, or as fixed-size binary records appended to a memory-mapped file,
+ * which prosim-trace turns back into text.
+ */
+
+enum {
+    TRACE_NEW, TRACE_READY, TRACE_RUNNING, TRACE_BLOCKED, TRACE_FINISHED,
+    TRACE_BLOCKED_SEND, TRACE_BLOCKED_RECV, TRACE_BLOCKED_BCAST, TRACE_BLOCKED_GATHER, TRACE_BLOCKED_BARRIER,
+    TRACE_MIGRATED, TRACE_LAST
+};
+
+/* An event, which is also the record of the binary trace file.
+ * The file starts with a trace_header and is followed by the records in trace order.
+ */
+typedef struct trace_event {
+    long long tick;
+    int thread;                 /* node the process belongs to, which labels the event */
+    int pid;
+    short state;                /* one of the TRACE_ values above */
+    short op;                   /* primitive the process is at, OP_LAST before its first one */
+    int arg;                    /* node a process migrated to, 0 otherwise */
+} trace_event_t;
+
+typedef struct trace_header {
+    char magic[8];
+    int version;
+    int record_size;            /* sizeof(trace_event_t) */
+} trace_header_t;
+
+typedef struct trace {
+    trace_event_t *events;      /* events not written out yet, in the order the node wrote them */
+    int count;
+    int capacity;
+    int sorted;                 /* 1 while the events are in tick order */
+} trace_t;
+
+/* Creates an empty trace buffer
+ * @params:
+ *   none
+ * @returns:
+ *   pointer to the new buffer
+ */
+extern trace_t *trace_new();
+
+/* Appends an event to a node's trace buffer
+ * @params:
+ *   trace : buffer of the node writing the event
+ *   tick  : tick of the event
+ *   thread: node the process belongs to
+ *   pid   : process id
+ *   state : one of the TRACE_ values
+ *   op    : primitive the process is at, OP_LAST before its first one
+ *   arg   : node a process migrated to, 0 otherwise
+ * @returns:
+ *   none
+ */
+extern void trace_add(trace_t *trace, long long tick, int thread, int pid, int state, int op, int arg);
+
+/* Writes out the events of every buffer before the given tick, merged in trace order
+ * No node may be writing to its buffer meanwhile.
+ * @params:
+ *   traces: buffers of the nodes, in node order
+ *   n     : number of buffers
+ *   upto  : tick from which events stay buffered, as a node could still write earlier ones
+ *   fout  : file to write the events to as text, unless a binary trace file is open
+ * @returns:
+ *   none
+ */
+extern void trace_merge(trace_t **traces, int n, long long upto, FILE *fout);
+
+/* Writes one event in the text format of the trace
+ * @params:
+ *   event: the event
+ *   fout : file to write the event to
+ * @returns:
+ *   none
+ */
+extern void trace_print(const trace_event_t *event, FILE *fout);
+
+/* Sends the merged trace to a binary trace file instead of text
+ * @params:
+ *   path: file to create, replacing any file of that name
+ * @returns:
+ *   1 on success, 0 if the file could not be created
+ */
+extern int trace_open(const char *path);
+
+/* Trims the binary trace file to the records written and closes it, if one is open
+ * @params:
+ *   none
+ * @returns:
+ *   none
+ */
+extern void trace_close();
+
+#endif
@@ -0,0 +1,314 @@
+
+#include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
+#include "wheel.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN_BITS (WHEEL_BITS * WHEEL_LEVELS)
+
+/* Creates an empty timing wheel starting at time 0 and returns a pointer to it.
+ * @params:
+ *   none
+ * @returns:
+ *   pointer to the new timing wheel or NULL if an error has occurred
+ */
+extern wheel_t *wheel_new() {
+    wheel_t *wheel = calloc(1, sizeof(wheel_t));
+    assert(wheel != NULL);
+    wheel->overflow = prio_q_new();
+    return wheel;
+}
+
+/* Returns the level on which an item with the given wake-up time belongs.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   wake : wake-up time of the item, not earlier than the current time
+ * @returns:
+ *   level of the wheel or WHEEL_LEVELS if the item belongs in the overflow queue
+ */
+static int wheel_level(wheel_t *wheel, long long wake) {
+    unsigned long long diff = (unsigned long long)wake ^ (unsigned long long)wheel->cur;
+    int level = 0;
+    while (level < WHEEL_LEVELS && (diff >> (WHEEL_BITS * (level + 1))) != 0) {
+        level++;
+    }
+    return level;
+}
+
+/* Appends a node to the slot for its wake-up time, or to the overflow queue.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   node : node to be placed
+ * @returns:
+ *   none
+ */
+static void wheel_place(wheel_t *wheel, node_t *node) {
+    int level = wheel_level(wheel, node->priority);
+    if (level == WHEEL_LEVELS) {
+        prio_q_add_node(wheel->overflow, node, node->contents, node->priority);
+        return;
+    }
+
+    wheel_slot_t *slot = &wheel->slots[level][(node->priority >> (WHEEL_BITS * level)) & SLOT_MASK];
+    node->next = NULL;
+    if (slot->tail) {
+        slot->tail->next = node;
+    } else {
+        slot->head = node;
+    }
+    slot->tail = node;
+    wheel->count[level]++;
+}
+
+/* Moves every item in the block the current time just entered down to the lower levels.
+ * Slot lists are re-placed in order, so items with the same wake-up time keep insertion order.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   level : level whose block boundary was crossed, WHEEL_LEVELS for the overflow queue
+ * @returns:
+ *   none
+ */
+static void wheel_cascade(wheel_t *wheel, int level) {
+    if (level == WHEEL_LEVELS) {
+        while (!prio_q_empty(wheel->overflow)) {
+            node_t *node = wheel->overflow->heap[0];
+            if ((node->priority >> WHEEL_SPAN_BITS) != (wheel->cur >> WHEEL_SPAN_BITS)) {
+                break;
+            }
+            prio_q_erase(wheel->overflow, node);
+            wheel_place(wheel, node);
+        }
+        return;
+    }
+
+    wheel_slot_t *slot = &wheel->slots[level][(wheel->cur >> (WHEEL_BITS * level)) & SLOT_MASK];
+    node_t *node = slot->head;
+    slot->head = NULL;
+    slot->tail = NULL;
+    while (node) {
+        node_t *next = node->next;
+        wheel->count[level]--;
+        wheel_place(wheel, node);
+        node = next;
+    }
+}
+
+/* Advances the current time of the wheel towards now by at least one tick.
+ * Stretches of time in which the lower levels are empty are skipped a whole block at a time.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   now : time to advance towards, must be later than the current time
+ * @returns:
+ *   none
+ */
+static void wheel_advance(wheel_t *wheel, long long now) {
+    if (wheel->size == 0) {
+        wheel->cur = now;
+        return;
+    }
+
+    /* Nothing can be due before the end of the block of the lowest non-empty level.
+     */
+    int empty = 0;
+    while (empty < WHEEL_LEVELS && wheel->count[empty] == 0) {
+        empty++;
+    }
+    if (empty > 0) {
+        long long block_end = wheel->cur | ((1LL << (WHEEL_BITS * empty)) - 1);
+        if (block_end >= now) {
+            wheel->cur = now;
+            return;
+        }
+        wheel->cur = block_end;
+    }
+
+    /* Step into the next tick and cascade every level whose block boundary was crossed,
+     * highest level first so that items trickle all the way down.
+     */
+    long long prev = wheel->cur;
+    wheel->cur++;
+    for (int level = WHEEL_LEVELS; level > 0; level--) {
+        if ((prev >> (WHEEL_BITS * level)) != (wheel->cur >> (WHEEL_BITS * level))) {
+            wheel_cascade(wheel, level);
+        }
+    }
+}
+
+/* Adds an item to the wheel using a node supplied by the caller.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   node : node to link into the wheel, must not be in any queue
+ *   contents : pointer to item to be added
+ *   wake : time at which the item becomes due, times before the current time are treated as now
+ * @returns:
+ *   none
+ */
+extern void wheel_add(wheel_t *wheel, node_t *node, void *contents, long long wake) {
+    assert(wheel != NULL);
+    assert(node != NULL);
+
+    node->contents = contents;
+    node->priority = wake < wheel->cur ? wheel->cur : wake;
+    wheel_place(wheel, node);
+    wheel->size++;
+}
+
+/* Removes and returns the next item that is due at or before the given time.
+ * Items are returned in order of wake-up time and then in order of insertion.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   now : current time, must not be earlier than a previous call
+ * @returns:
+ *   pointer to the item or NULL if no item is due
+ */
+extern void *wheel_remove_due(wheel_t *wheel, long long now) {
+    assert(wheel != NULL);
+
+    for (;;) {
+        wheel_slot_t *slot = &wheel->slots[0][wheel->cur & SLOT_MASK];
+        if (slot->head) {
+            node_t *node = slot->head;
+            slot->head = node->next;
+            if (slot->head == NULL) {
+                slot->tail = NULL;
+            }
+            wheel->count[0]--;
+            wheel->size--;
+            return node->contents;
+        }
+        if (wheel->cur >= now) {
+            return NULL;
+        }
+        wheel_advance(wheel, now);
+    }
+}
+
+/* Returns the earliest wake-up time of the items in the wheel.
+ * Lower levels always hold earlier items than higher levels, so the first non-empty slot
+ * after the current time, searching upwards from level 0, holds the earliest items.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ * @returns:
+ *   earliest wake-up time, or LLONG_MAX if the wheel is empty
+ */
+extern long long wheel_next(wheel_t *wheel) {
+    assert(wheel != NULL);
+
+    if (wheel->size == 0) {
+        return LLONG_MAX;
+    }
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (wheel->count[level] == 0) {
+            continue;
+        }
+
+        /* Slots of level 0 hold a single wake-up time each. Higher slots span a block,
+         * so their list is scanned for the earliest item.
+         */
+        int shift = WHEEL_BITS * level;
+        int first = ((wheel->cur >> shift) & SLOT_MASK) + (level > 0);
+        for (int i = first; i < WHEEL_SLOTS; i++) {
+            node_t *node = wheel->slots[level][i].head;
+            if (node == NULL) {
+                continue;
+            }
+            long long wake = node->priority;
+            for (node = node->next; node; node = node->next) {
+                if (node->priority < wake) {
+                    wake = node->priority;
+                }
+            }
+            return wake;
+        }
+    }
+
+    node_t *node = wheel->overflow->heap[0];
+    return node->priority;
+}
+
+/* Calls a function on every item in the wheel, in no particular order.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   visit : function called with each item's contents and wake-up time
+ *   arg : passed through to visit
+ * @returns:
+ *   none
+ */
+extern void wheel_foreach(wheel_t *wheel, void (*visit)(void *contents, long long wake, void *arg), void *arg) {
+    assert(wheel != NULL);
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; wheel->count[level] > 0 && i < WHEEL_SLOTS; i++) {
+            for (node_t *node = wheel->slots[level][i].head; node; node = node->next) {
+                visit(node->contents, node->priority, arg);
+            }
+        }
+    }
+    for (int i = 0; i < wheel->overflow->size; i++) {
+        node_t *node = wheel->overflow->heap[i];
+        visit(node->contents, node->priority, arg);
+    }
+}
+
+/* Orders nodes on wake-up time, then on the rank wheel_foreach_ordered gave them.
+ */
+static int compare_wake(const void *a, const void *b) {
+    const node_t *x = *(node_t * const *)a;
+    const node_t *y = *(node_t * const *)b;
+    if (x->priority != y->priority) {
+        return x->priority < y->priority ? -1 : 1;
+    }
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* Calls a function on every item in the wheel, in the order wheel_remove_due would return them.
+ * Items with the same wake-up time are always in the same slot list, or all in the overflow queue,
+ * so their rank is their position in the list or their sequence number in the queue.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   visit : function called with each item's contents and wake-up time
+ *   arg : passed through to visit
+ * @returns:
+ *   none
+ */
+extern void wheel_foreach_ordered(wheel_t *wheel, void (*visit)(void *contents, long long wake, void *arg), void *arg) {
+    assert(wheel != NULL);
+    if (wheel->size == 0) {
+        return;
+    }
+
+    node_t **nodes = malloc(wheel->size * sizeof(node_t *));
+    assert(nodes != NULL);
+    int n = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; wheel->count[level] > 0 && i < WHEEL_SLOTS; i++) {
+            for (node_t *node = wheel->slots[level][i].head; node; node = node->next) {
+                node->seq = n;
+                nodes[n++] = node;
+            }
+        }
+    }
+    for (int i = 0; i < wheel->overflow->size; i++) {
+        nodes[n++] = wheel->overflow->heap[i];
+    }
+    assert(n == wheel->size);
+
+    qsort(nodes, n, sizeof(node_t *), compare_wake);
+    for (int i = 0; i < n; i++) {
+        visit(nodes[i]->contents, nodes[i]->priority, arg);
+    }
+    free(nodes);
+}
+
+/* Returns true if the wheel is empty
+ * @params:
+ *   wheel : pointer to the timing wheel
+ * @returns:
+ *   1 if wheel is empty and 0 otherwise.
+ */
+extern int wheel_empty(wheel_t *wheel) {
+    assert(wheel != NULL);
+    return wheel->size == 0;
+}
@@ -0,0 +1,102 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include "prio_q.h"
+
+/* This is a hierarchical timing wheel (calendar queue) for items keyed on an absolute wake-up time.
+ * Items are stored in FIFO slot lists, so adding an item and removing a due item are O(1).
+ * Level 0 has one slot per tick, each higher level has one slot per block of 64 slots of the level
+ * below, and items too far in the future to fit in the wheel are parked in an overflow queue.
+ * An item is placed on the lowest level whose block it shares with the current time, and is moved
+ * down (cascaded) when the current time enters its block.
+ * Items with the same wake-up time are removed in the order they were added, which is the same
+ * order a prio_q keyed on wake-up time would produce.
+ * The wheel never allocates: it links a node_t supplied by the caller, usually embedded in the item,
+ * with priority holding the wake-up time. The same node can be linked into a prio_q with
+ * prio_q_add_node once it has left the wheel (see prio_q.h).
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_slot {
+    node_t *head;             /* pointer to head node in slot list or null if empty */
+    node_t *tail;             /* pointer to tail node in slot list or null if empty */
+} wheel_slot_t;
+
+typedef struct wheel {
+    wheel_slot_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    int count[WHEEL_LEVELS];  /* number of items on each level */
+    int size;                 /* number of items in the wheel, including overflow */
+    long long cur;            /* current time of the wheel, every item due before it has been removed */
+    prio_q_t *overflow;       /* items beyond the top level, keyed on wake-up time */
+} wheel_t;
+
+/* Creates an empty timing wheel starting at time 0 and returns a pointer to it.
+ * @params:
+ *   none
+ * @returns:
+ *   pointer to the new timing wheel or NULL if an error has occurred
+ */
+extern wheel_t *wheel_new();
+
+/* Adds an item to the wheel using a node supplied by the caller.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   node : node to link into the wheel, must not be in any queue
+ *   contents : pointer to item to be added
+ *   wake : time at which the item becomes due, times before the current time are treated as now
+ * @returns:
+ *   none
+ */
+extern void wheel_add(wheel_t *wheel, node_t *node, void *contents, long long wake);
+
+/* Removes and returns the next item that is due at or before the given time.
+ * Items are returned in order of wake-up time and then in order of insertion.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   now : current time, must not be earlier than a previous call
+ * @returns:
+ *   pointer to the item or NULL if no item is due
+ */
+extern void *wheel_remove_due(wheel_t *wheel, long long now);
+
+/* Returns the earliest wake-up time of the items in the wheel.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ * @returns:
+ *   earliest wake-up time, or LLONG_MAX if the wheel is empty
+ */
+extern long long wheel_next(wheel_t *wheel);
+
+/* Calls a function on every item in the wheel, in no particular order.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   visit : function called with each item's contents and wake-up time
+ *   arg : passed through to visit
+ * @returns:
+ *   none
+ */
+extern void wheel_foreach(wheel_t *wheel, void (*visit)(void *contents, long long wake, void *arg), void *arg);
+
+/* Calls a function on every item in the wheel, in the order wheel_remove_due would return them.
+ * Adding the items to an empty wheel in this order gives back a wheel that behaves the same.
+ * @params:
+ *   wheel : pointer to the timing wheel
+ *   visit : function called with each item's contents and wake-up time
+ *   arg : passed through to visit
+ * @returns:
+ *   none
+ */
+extern void wheel_foreach_ordered(wheel_t *wheel, void (*visit)(void *contents, long long wake, void *arg), void *arg);
+
+/* Returns true if the wheel is empty
+ * @params:
+ *   wheel : pointer to the timing wheel
+ * @returns:
+ *   1 if wheel is empty and 0 otherwise.
+ */
+extern int wheel_empty(wheel_t *wheel);
+
+#endif //WHEEL_H